@@ -0,0 +1,93 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Echo throughput client for 0_smoke_test.
+ * usage: 0_smoke_bench [gigabytes] [host] [port]
+ * defaults to 4GB to localhost 8088. Compare the two echo paths with:
+ *   ./0_smoke_test &         then  ./0_smoke_bench 8
+ *   ./0_smoke_test --copy &  then  ./0_smoke_bench 8
+ * One thread sends, the main thread reads the echo back and counts it. */
+
+#define CHUNK (1024 * 1024)
+
+typedef struct sender {
+  int sock;
+  uint64_t total;
+} sender;
+
+static void *send_all(void *arg) {
+  sender *s = arg;
+  char *buf = malloc(CHUNK);
+  if(!buf) return NULL;
+  for(int i = 0; i < CHUNK; i++) buf[i] = 'a' + i % 26;
+  for(uint64_t sent = 0; sent < s->total; ) {
+    size_t len = s->total - sent < CHUNK ? s->total - sent : CHUNK;
+    ssize_t w = write(s->sock, buf, len);
+    if(w <= 0) {
+      perror("write");
+      break;
+    }
+    sent += w;
+  }
+  shutdown(s->sock, SHUT_WR);
+  free(buf);
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  double gb = 4;
+  if(argc > 1) {
+    char *end;
+    gb = strtod(argv[1], &end);
+    if(end == argv[1] || *end || !(gb > 0) || gb > 1e6) {
+      fprintf(stderr, "usage: %s [gigabytes] [host] [port]\n", argv[0]);
+      return 2;
+    }
+  }
+  const char *host = argc > 2 ? argv[2] : "127.0.0.1";
+  const char *port = argc > 3 ? argv[3] : "8088";
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+  if(getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "Can't resolve %s:%s\n", host, port);
+    return 1;
+  }
+  int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if(sock < 0 || connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+    perror("connect");
+    return 1;
+  }
+  freeaddrinfo(ai);
+
+  sender s = { .sock = sock, .total = (uint64_t) (gb * 1024 * 1024 * 1024) };
+  char *buf = malloc(CHUNK);
+  if(!buf) return 1;
+  double start = now();
+  pthread_t t;
+  pthread_create(&t, NULL, send_all, &s);
+  uint64_t got = 0;
+  ssize_t r;
+  while((r = read(sock, buf, CHUNK)) > 0) got += r;
+  pthread_join(t, NULL);
+  double secs = now() - start;
+
+  printf("echoed %.2f of %.2f GB in %.2fs, %.2f GB/s\n",
+         got / 1073741824.0, s.total / 1073741824.0, secs, got / 1073741824.0 / secs);
+  close(sock);
+  free(buf);
+  return got == s.total ? 0 : 1;
+}
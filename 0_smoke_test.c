@@ -1,16 +1,61 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
 #define SERVER_IMPLEMENTATION
 #include "server.h"
 
+#define PIPE_SIZE (1024*1024)
+#define COPY_BUF_SIZE (64*1024)
+
+bool use_splice = true;
+
+// Echo by moving pages socket -> pipe -> socket, data is not copied
+// to user space. Returns false if splice doesn't work for this socket
+// and nothing was echoed yet.
+bool echo_splice(int sock) {
+  int p[2];
+  if(pipe2(p, O_CLOEXEC) < 0) return false;
+  fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+  bool started = false;
+  ssize_t in;
+  while((in = splice(sock, NULL, p[1], NULL, PIPE_SIZE, SPLICE_F_MOVE)) > 0) {
+    started = true;
+    while(in > 0) {
+      ssize_t out = splice(p[0], NULL, sock, NULL, in, SPLICE_F_MOVE);
+      if(out <= 0) goto done;
+      in -= out;
+    }
+  }
+  if(in < 0 && !started && (errno == EINVAL || errno == ENOSYS)) {
+    close(p[0]); close(p[1]);
+    return false;
+  }
+ done:
+  close(p[0]); close(p[1]);
+  return true;
+}
+
+void echo_copy(int sock) {
+  char *buf = malloc(COPY_BUF_SIZE);
+  if(!buf) return;
+  ssize_t r;
+  while((r = read(sock, buf, COPY_BUF_SIZE)) > 0) {
+    for(ssize_t at = 0, w; at < r; at += w) {
+      if((w = write(sock, buf + at, r - at)) <= 0) goto done;
+    }
+  }
+ done:
+  free(buf);
+}
+
 void echo(conn_state *c) {
-  char buf[512];
-  int r;
   printf("got socket: %d\n", c->socket);
-  while((r = read(c->socket, buf, 512)) > 0) {
-    write(c->socket, buf, r);
-  }
+  if(use_splice && echo_splice(c->socket)) return;
+  echo_copy(c->socket);
 }
 
 int main(int argc, char **argv) {
+  // --copy to echo through a user space buffer, for comparison
+  if(argc > 1 && strcmp(argv[1], "--copy") == 0) use_splice = false;
 
   serve(.port = 8088, .handler = echo);
 
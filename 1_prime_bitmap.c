@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <stdlib.h>
+#define PRIME_BITMAP_IMPLEMENTATION
+#include "prime_bitmap.h"
+
+/* Build the prime bitmap used by 1_prime_time.
+ * usage: 1_prime_bitmap [file] [limit]
+ * defaults to primes.bm with all numbers below 2^32 */
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "primes.bm";
+  uint64_t limit = argc > 2 ? strtoull(argv[2], NULL, 10) : (1ull << 32);
+
+  int64_t count = prime_bitmap_write(path, limit);
+  if(count < 0) return 1;
+  printf("%s: %ld primes below %lu\n", path, (long) count, (unsigned long) limit);
+  return 0;
+}
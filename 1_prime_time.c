@@ -2,6 +2,54 @@
 #include "server.h"
 #define JSON_IMPLEMENTATION
 #include "json.h"
+#define PRIME_BITMAP_IMPLEMENTATION
+#include "prime_bitmap.h"
+#define HASH_IMPLEMENTATION
+#include "hash.h"
+
+// bitmap for small numbers, built by 1_prime_bitmap (empty if not found)
+prime_bitmap primes;
+
+static char *skip_spaces(char *at) {
+  while(*at == ' ' || *at == '\t' || *at == '\r') at++;
+  return at;
+}
+
+#define FAST_EXPECT(lit)                                                       \
+  at = skip_spaces(at);                                                        \
+  if (strncmp(at, lit, sizeof(lit) - 1) != 0) return false;                    \
+  at += sizeof(lit) - 1;
+
+/* Single pass matcher for the canonical request shape:
+ * {"method":"isPrime","number":N} with optional whitespace between tokens
+ * and N an integer of at most 18 digits. Returns false for anything else
+ * (field order, fractions, exponents, extra fields...), the caller then
+ * falls back to the full JSON parser. */
+bool parse_request_fast(char *at, double *number) {
+  FAST_EXPECT("{");
+  FAST_EXPECT("\"method\"");
+  FAST_EXPECT(":");
+  FAST_EXPECT("\"isPrime\"");
+  FAST_EXPECT(",");
+  FAST_EXPECT("\"number\"");
+  FAST_EXPECT(":");
+  at = skip_spaces(at);
+  bool negative = *at == '-';
+  if(negative) at++;
+  long n = 0;
+  int digits = 0;
+  while(*at >= '0' && *at <= '9') {
+    if(++digits > 18) return false;
+    n = n * 10 + (*at++ - '0');
+  }
+  if(digits == 0 || *at == '.' || *at == 'e' || *at == 'E') return false;
+  FAST_EXPECT("}");
+  at = skip_spaces(at);
+  if(*at != 0) return false;
+  *number = (double) (negative ? -n : n);
+  return true;
+}
+#undef FAST_EXPECT
 
 bool parse_request(char *data, char *method, double *number) {
   char **at = &data;
@@ -14,48 +62,246 @@ bool parse_request(char *data, char *method, double *number) {
   return has_method && has_number;
 };
 
+/* Montgomery form mod odd n: x is kept as x*2^64 mod n, so multiplying
+ * needs no division. */
+typedef struct mont {
+  uint64_t n;
+  uint64_t ninv; // n^-1 mod 2^64
+  uint64_t one;  // 2^64 mod n
+} mont;
+
+static mont mont_init(uint64_t n) {
+  uint64_t x = n; // correct to 3 bits, each step doubles that
+  for(int i = 0; i < 5; i++) x *= 2 - n * x;
+  return (mont) { .n = n, .ninv = x, .one = (0 - n) % n };
+}
+
+// t / 2^64 mod n, for t < n*2^64
+static inline uint64_t mont_redc(const mont *m, __uint128_t t) {
+  uint64_t q = (uint64_t) t * m->ninv;
+  uint64_t hi = t >> 64, qn = ((__uint128_t) q * m->n) >> 64;
+  return hi >= qn ? hi - qn : hi - qn + m->n;
+}
+
+static inline uint64_t mont_mul(const mont *m, uint64_t a, uint64_t b) {
+  return mont_redc(m, (__uint128_t) a * b);
+}
+
+static inline uint64_t mont_from(const mont *m, uint64_t a) {
+  return ((__uint128_t) a << 64) % m->n;
+}
+
+/* Strong probable prime test of odd n = d*2^s + 1 to base a */
+static bool miller_rabin(const mont *m, uint64_t a, uint64_t d, int s) {
+  a %= m->n;
+  if(a == 0) return true;
+  uint64_t minus_one = m->n - m->one;
+  uint64_t base = mont_from(m, a), x = m->one;
+  for(; d; d >>= 1) {
+    if(d & 1) x = mont_mul(m, x, base);
+    base = mont_mul(m, base, base);
+  }
+  if(x == m->one || x == minus_one) return true;
+  while(--s > 0) {
+    x = mont_mul(m, x, x);
+    if(x == minus_one) return true;
+  }
+  return false;
+}
+
+static const uint8_t small_primes[] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53
+};
+
+/* == Result cache ==
+ * Shared by all threads, fixed size and lock free. Each set is a cache
+ * line of 8 entries, an entry is a single word: number << 2, referenced
+ * bit and prime bit (0 is empty). Full sets evict with CLOCK: the hand
+ * clears referenced bits until it finds an entry not used since the last
+ * pass. Races only lose cache entries, never give wrong answers.
+ * Numbers up to 2^53 (larger ones never get here).
+ */
+#define CACHE_SETS 65536 // 4MB
+#define CACHE_WAYS 8
+#define CACHE_REF 2
+#define CACHE_PRIME 1
+#define CACHE_STRIPES 16
+
+typedef struct cache_set {
+  _Alignas(64) atomic_uint_fast64_t ways[CACHE_WAYS];
+} cache_set;
+
+// hit/miss counters, striped per thread so they don't bounce between cores
+typedef struct cache_counters {
+  _Alignas(64) atomic_long hits;
+  atomic_long misses;
+} cache_counters;
+
+static cache_set cache[CACHE_SETS];
+static atomic_uchar cache_hands[CACHE_SETS];
+static cache_counters cache_counts[CACHE_STRIPES];
+static atomic_int cache_next_stripe;
+static _Thread_local int cache_stripe = -1;
+
+static cache_counters *cache_counter(void) {
+  if(cache_stripe < 0) cache_stripe = atomic_fetch_add(&cache_next_stripe, 1) % CACHE_STRIPES;
+  return &cache_counts[cache_stripe];
+}
+
+/* 1 if n is cached as prime, 0 if cached as not prime, -1 if not cached */
+int prime_cache_get(uint64_t n) {
+  cache_set *set = &cache[hash_u64(n) & (CACHE_SETS - 1)];
+  for(int i = 0; i < CACHE_WAYS; i++) {
+    uint64_t e = atomic_load_explicit(&set->ways[i], memory_order_relaxed);
+    if(e >> 2 == n) {
+      if(!(e & CACHE_REF)) atomic_fetch_or_explicit(&set->ways[i], CACHE_REF, memory_order_relaxed);
+      atomic_fetch_add_explicit(&cache_counter()->hits, 1, memory_order_relaxed);
+      return e & CACHE_PRIME;
+    }
+  }
+  atomic_fetch_add_explicit(&cache_counter()->misses, 1, memory_order_relaxed);
+  return -1;
+}
+
+void prime_cache_put(uint64_t n, bool prime) {
+  uint64_t h = hash_u64(n) & (CACHE_SETS - 1);
+  cache_set *set = &cache[h];
+  uint64_t entry = (n << 2) | prime; // new entries start unreferenced
+  for(int i = 0; i < CACHE_WAYS; i++) {
+    uint64_t empty = 0;
+    if(atomic_compare_exchange_strong_explicit(&set->ways[i], &empty, entry,
+                                               memory_order_relaxed, memory_order_relaxed))
+      return;
+  }
+  // two passes clear all referenced bits, give up if others keep racing
+  for(int step = 0; step < 2 * CACHE_WAYS; step++) {
+    int i = atomic_fetch_add_explicit(&cache_hands[h], 1, memory_order_relaxed) % CACHE_WAYS;
+    uint64_t e = atomic_load_explicit(&set->ways[i], memory_order_relaxed);
+    uint64_t to = e & CACHE_REF ? e & ~(uint64_t) CACHE_REF : entry;
+    if(atomic_compare_exchange_strong_explicit(&set->ways[i], &e, to,
+                                               memory_order_relaxed, memory_order_relaxed) &&
+       to == entry)
+      return;
+  }
+}
+
+void prime_cache_stats(long *hits, long *misses) {
+  *hits = *misses = 0;
+  for(int i = 0; i < CACHE_STRIPES; i++) {
+    *hits += atomic_load_explicit(&cache_counts[i].hits, memory_order_relaxed);
+    *misses += atomic_load_explicit(&cache_counts[i].misses, memory_order_relaxed);
+  }
+}
+
+#define CACHE_REPORT_SECONDS 60
+
+/* Log the cache hit rate periodically, only when there was traffic */
+static void *prime_cache_reporter(void *arg) {
+  (void) arg;
+  long last_hits = 0, last_misses = 0;
+  while(1) {
+    sleep(CACHE_REPORT_SECONDS);
+    long hits, misses;
+    prime_cache_stats(&hits, &misses);
+    if(hits == last_hits && misses == last_misses) continue;
+    fprintf(stderr, "cache hits: %ld, misses: %ld (%.1f%% hit rate)\n",
+            hits, misses, 100.0 * hits / (hits + misses));
+    last_hits = hits;
+    last_misses = misses;
+  }
+  return NULL;
+}
+
+/* Deterministic for all 64 bit n */
+bool is_prime_u64(uint64_t n) {
+  if(n < 2) return false;
+  for(size_t i = 0; i < sizeof(small_primes); i++) {
+    if(n % small_primes[i] == 0) return n == small_primes[i];
+  }
+  if(n < 59 * 59) return true;
+
+  // only numbers that got past trial division are worth caching
+  bool cacheable = n < (1ull << 53);
+  int cached = cacheable ? prime_cache_get(n) : -1;
+  if(cached >= 0) return cached;
+
+  uint64_t d = n - 1;
+  int s = __builtin_ctzll(d);
+  d >>= s;
+  mont m = mont_init(n);
+  // Jim Sinclair's bases, enough for every n < 2^64
+  static const uint64_t witnesses[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+  bool prime = true;
+  for(size_t i = 0; prime && i < sizeof(witnesses)/sizeof(witnesses[0]); i++) {
+    prime = miller_rabin(&m, witnesses[i], d, s);
+  }
+  if(cacheable) prime_cache_put(n, prime);
+  return prime;
+}
+
 bool is_prime(double v) {
   dbg("double: %f", v);
-  long n = (long) v;
-  if(v - (double)n != 0.0) return false;
-  if(n <= 1) return false;
-  if(n <= 3) return true;
-  if(n%2 == 0 || n%3 == 0) return false;
-  for(long i=5; i*i <= n; i += 6) {
-    if(n%i == 0 || n%(i+2) == 0) return false;
-  }
-  return true;
+  if(!(v >= 2)) return false; // also NaN
+  // every double from 2^53 up is even
+  if(v >= 9007199254740992.0) return false;
+  uint64_t n = (uint64_t) v;
+  if(v != (double) n) return false;
+  int known = prime_bitmap_test(&primes, n);
+  if(known >= 0) return known;
+  return is_prime_u64(n);
 }
 
 
+// max requests answered before flushing responses, bounds pipelining latency
+#define MAX_BATCH 128
+#define OUT_SIZE 16384
+
 void prime_time(conn_state *c) {
   char *buf = malloc(65536);
-  while(1) {
-    // read until newline
-    if(!read_until(c->socket, buf, '\n', 65536)) {
-      err("failed to read line, closing socket %d", c->socket);
-      goto done;
-    }
-    char method[64] = {0};
-    double number;
-    if(parse_request(buf, method, &number) && strcmp(method, "isPrime")==0) {
-      char response[128];
-      size_t len = snprintf(response, 128,
-                            "{\"method\":\"isPrime\",\"prime\":%s}\n",
-                            is_prime(number) ? "true" : "false");
-      write(c->socket, response, len);
-    } else {
-      // malformed response
-      write(c->socket, "FAIL\n", 5);
-      break;
+  char *out = malloc(OUT_SIZE);
+  line_reader lr = {.socket = c->socket, .buf = buf, .size = 65536};
+  write_buffer wb = {.socket = c->socket, .buf = out, .size = OUT_SIZE};
+  static const char prime_true[] = "{\"method\":\"isPrime\",\"prime\":true}\n";
+  static const char prime_false[] = "{\"method\":\"isPrime\",\"prime\":false}\n";
+
+  while(line_reader_fill(&lr)) {
+    // answer all complete lines we have, in order
+    char *line;
+    int batch = 0;
+    while((line = line_reader_next(&lr, NULL))) {
+      char method[64] = {0};
+      double number;
+      if(parse_request_fast(line, &number) ||
+         (parse_request(line, method, &number) && strcmp(method, "isPrime")==0)) {
+        if(is_prime(number)) wbuf_write(&wb, prime_true, sizeof(prime_true)-1);
+        else wbuf_write(&wb, prime_false, sizeof(prime_false)-1);
+      } else {
+        // malformed response
+        wbuf_write(&wb, "FAIL\n", 5);
+        wbuf_flush(&wb);
+        goto done;
+      }
+      if(++batch == MAX_BATCH) {
+        wbuf_flush(&wb);
+        batch = 0;
+      }
     }
+    wbuf_flush(&wb);
   }
+  err("failed to read line, closing socket %d", c->socket);
  done:
   free(buf);
+  free(out);
 }
 
 
 int main(int argc, char **argv) {
+  const char *bitmap = argc > 1 ? argv[1] : "primes.bm";
+  if(!prime_bitmap_open(&primes, bitmap)) {
+    err("No prime bitmap at %s, testing all numbers arithmetically", bitmap);
+  }
 
+  pthread_t reporter;
+  if(pthread_create(&reporter, NULL, prime_cache_reporter, NULL) == 0) pthread_detach(reporter);
   serve(.port = 8088, .handler = prime_time);
 }
@@ -1,85 +1,137 @@
 #include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif
 #define SERVER_IMPLEMENTATION
 #include "server.h"
+#define SLAB_IMPLEMENTATION
+#include "slab.h"
+#define BTREE_IMPLEMENTATION
+#include "btree.h"
+#define DYNARR_IMPLEMENTATION
+#include "dynarr.h"
+#define COLSTORE_IMPLEMENTATION
+#include "colstore.h"
 
-typedef struct price {
-  int32_t ts; // seconds since epoch
-  int32_t price; // price in pennies
-} price;
+// --columnar: keep prices in compressed blocks instead of a B+tree,
+// uses a fraction of the memory for long sessions
+bool columnar = false;
 
-int compare_by_ts(const void *a, const void *b) {
-  return ((price*)a)->ts - ((price*)b)->ts;
+#define READ_SIZE (9*7281) // largest multiple of the message size under 64k
+#define MSG_SIZE 9
+#define BATCH 256 // messages decoded at a time
+#define OUT_SIZE 4096
+
+/* Big endian to host order in place */
+static void bswap32_n_scalar(uint32_t *v, size_t n) {
+  for(size_t i = 0; i < n; i++) v[i] = ntohl(v[i]);
 }
 
-void means_to_an_end(conn_state *c) {
-  uint8_t msg[9];
-  int r;
-  price *p;
+#if defined(__x86_64__) || defined(__i386__)
+// compiled for SSSE3 regardless of -m flags, only called if the cpu has it
+__attribute__((target("ssse3")))
+static void bswap32_n_ssse3(uint32_t *v, size_t n) {
+  const __m128i rev = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (v + i));
+    _mm_storeu_si128((__m128i *) (v + i), _mm_shuffle_epi8(x, rev));
+  }
+  bswap32_n_scalar(v + i, n - i);
+}
+#endif
 
-  price *prices = malloc(100*sizeof(price));
-  int count=0;
-  int capacity=100;
+static void bswap32_n(uint32_t *v, size_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+  static int ssse3 = -1;
+  if(ssse3 < 0) ssse3 = __builtin_cpu_supports("ssse3");
+  if(ssse3) {
+    bswap32_n_ssse3(v, n);
+    return;
+  }
+#endif
+  bswap32_n_scalar(v, n);
+}
 
-  bool sorted=true;
+void means_to_an_end(conn_state *c) {
+  uint8_t *buf = malloc(READ_SIZE);
+  char out[OUT_SIZE];
+  write_buffer wb = {.socket = c->socket, .buf = out, .size = OUT_SIZE};
+  size_t have = 0;
+  ssize_t r;
 
-  while(1) {
-    if((r = recv(c->socket, msg, 9, MSG_WAITALL)) < 9) {
-      for(int i=0;i<r;i++) printf(" read byte: %d (%c)\n", msg[i], msg[i]);
-      err("read %d, closing socket %d", r, c->socket);
-      break;
-    }
-    switch(msg[0]) {
-    case 'I': {
-      int32_t ts = ntohl(*((int32_t*)&msg[1]));
-      int32_t pr = ntohl(*((int32_t*)&msg[5]));
-      if(count == capacity) {
-        capacity = capacity * 1.618; // increase by golden ratio
-        prices = realloc(prices, capacity * sizeof(price));
-        if(!prices) {
-          err("Can't realloc to %d * sizeof(price)", capacity);
-          return;
-        }
-      }
-      prices[count++] = (price) {.ts = ts, .price = pr};
-      sorted = false;
-      dbg("(%d) Insert: ts=%d, price=%d", count, ts, pr);
-      break;
-    }
-    case 'Q': {
-      int32_t min_ts = ntohl(*((int32_t*)&msg[1]));
-      int32_t max_ts = ntohl(*((int32_t*)&msg[5]));
-      int64_t total = 0;
-      int32_t cnt = 0;
-      price *at = p;
-      if(!sorted) {
-        qsort(prices, count, sizeof(price), compare_by_ts);
-        sorted = true;
+  // timestamp (seconds since epoch) -> price in pennies
+  btree prices = {0};
+  colstore prices_columnar = {0};
+
+  // read as much as is available, handle all complete messages and send
+  // the answers to all queries in them with one write
+  while((r = recv(c->socket, buf + have, READ_SIZE - have, 0)) > 0) {
+    have += r;
+    size_t msgs = have / MSG_SIZE;
+    for(size_t at = 0; at < msgs; ) {
+      size_t n = msgs - at < BATCH ? msgs - at : BATCH;
+      // gather the two fields of each message, swap them all at once
+      uint8_t types[BATCH];
+      int32_t fields[2*BATCH];
+      for(size_t i = 0; i < n; i++) {
+        uint8_t *msg = buf + (at + i) * MSG_SIZE;
+        types[i] = msg[0];
+        memcpy(&fields[2*i], msg + 1, 8);
       }
+      bswap32_n((uint32_t *) fields, 2*n);
 
-      int i=0;
-      while(i < count && prices[i].ts < min_ts) i++;
-      while(i < count && prices[i].ts <= max_ts) {
-        total += prices[i++].price;
-        cnt++;
+      for(size_t i = 0; i < n; i++) {
+        int32_t a = fields[2*i], b = fields[2*i + 1];
+        switch(types[i]) {
+        case 'I':
+          if(columnar) {
+            if(!colstore_insert(&prices_columnar, a, b)) {
+              // later means would silently miss it
+              err("Out of memory storing price, closing.");
+              goto done;
+            }
+          } else {
+            btree_insert(&prices, a, b);
+          }
+          dbg("(%d) Insert: ts=%d, price=%d", prices.count + prices_columnar.count, a, b);
+          break;
+        case 'Q': {
+          int64_t total;
+          uint32_t cnt;
+          if(columnar) colstore_range(&prices_columnar, a, b, &cnt, &total);
+          else btree_range(&prices, a, b, &cnt, &total);
+          int32_t average = cnt ? total/cnt : 0;
+          dbg("Query: min_ts=%d,max_ts=%d => total=%ld,count=%d,average=%d",
+              a, b, total, cnt, average);
+          int32_t avg = htonl(average);
+          wbuf_write(&wb, &avg, 4);
+          break;
+        }
+        default:
+          err("Unexpected message type: %c, closing.", types[i]);
+          goto done;
+        }
       }
-      dbg("Query: min_ts=%d,max_ts=%d => total=%lld,count=%d,average=%d",
-          min_ts, max_ts, total, cnt, (int32_t) (total/cnt));
-      int32_t avg = htonl(total/cnt);
-      write(c->socket, &avg, 4);
-      break;
-    }
-    default:
-      err("Unexpected message type: %c, closing.", msg[0]);
-      goto done;
+      at += n;
     }
+    wbuf_flush(&wb);
+    // keep partial message for the next read
+    memmove(buf, buf + msgs * MSG_SIZE, have - msgs * MSG_SIZE);
+    have -= msgs * MSG_SIZE;
   }
+  err("read %ld (%zu bytes of partial message), closing socket %d", (long) r, have, c->socket);
 
   done:
+  wbuf_flush(&wb);
   // free measurements
-  free(prices);
+  btree_free(&prices);
+  colstore_free(&prices_columnar);
+  free(buf);
 }
 
 
 int main(int argc, char **argv) {
+  if(argc > 1 && strcmp(argv[1], "--columnar") == 0) columnar = true;
   serve(.handler = means_to_an_end);
 }
@@ -1,6 +1,38 @@
 #include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
 #define SERVER_IMPLEMENTATION
 #include "server.h"
+#define DYNARR_IMPLEMENTATION
+#include "dynarr.h"
+#define HASH_IMPLEMENTATION
+#include "hashmap.h"
+#define INTERN_IMPLEMENTATION
+#include "intern.h"
+#define SYNC_IMPLEMENTATION
+#include "sync.h"
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
+#define SLAB_IMPLEMENTATION
+#include "slab.h"
+
+/* Chat rooms served by a reactor thread per core. Joining as "name@room"
+ * enters that room, plain "name" the default room.
+ *
+ * Each reactor (shard) only knows its own connections and which rooms
+ * they are in. A message goes to the local members of the room directly
+ * and to the other shards with members in the room through their
+ * mailboxes, they deliver it to their local members.
+ *
+ * Writes never block. What a client doesn't take right away waits in its
+ * outbox, when that is full the policy decides what to give up on:
+ *   --policy=disconnect (default), drop-oldest or drop-new
+ *   --outbox=N messages (default 256)
+ */
+
+#define MAX_NAME 16
+#define IN_SIZE 2048 // input buffer, longest line is one less
+#define MAILBOX_SIZE 65536
 
 typedef enum participant_state {
   PS_INITIAL = 0,
@@ -8,133 +40,447 @@ typedef enum participant_state {
   PS_CHATTING = 2
 } participant_state;
 
+DefineArray(char_array, char);
+
+typedef struct room {
+  const char *name; // interned
+  atomic_uint_fast64_t shards; // bit for each shard with members here
+  mutex lock; // roster
+  char_array roster; // "name1, name2, ..." of everyone in the room
+} room;
+
+typedef enum full_policy { FULL_DISCONNECT, FULL_DROP_OLDEST, FULL_DROP_NEW } full_policy;
+
+full_policy policy = FULL_DISCONNECT;
+uint32_t outbox_max = 256;
+
+typedef struct pending_msg {
+  char *data; // slab buffer
+  uint32_t len;
+} pending_msg;
+
+/* Messages waiting for a slow client */
+typedef struct outbox {
+  pending_msg *msgs; // ring of outbox_max, allocated on first use
+  uint32_t head, count;
+  uint32_t head_sent; // bytes of the first message already sent
+} outbox;
+
 typedef struct participant {
   participant_state state;
-  char name[17]; // 16 chars + nul
-  char msg[512]; // buffer to read incoming message
-  int read_pos; // position of reading to msg
+  bool closing; // disconnected for being too slow, waiting for hangup
+  outbox out;
+  char name[MAX_NAME+1]; // 16 chars + nul
+  room *room;
+  uint32_t member_idx; // index in shard's member list of the room
+  line_reader in; // lines read from client
+  char in_buf[IN_SIZE];
 } participant;
 
-typedef struct chat {
-  int num_participants;
-  participant *participants;
+DefineArray(conn_list, conn_state *);
+DefineHashMap(room_members, room *, conn_list, hm_hash_int, hm_int_eq);
 
-} chat;
+/* Message from another shard, shared by all shards it was sent to */
+typedef struct chat_msg {
+  atomic_int refs;
+  room *room;
+  size_t len;
+  char data[];
+} chat_msg;
 
-chat c = {0};
+typedef struct shard {
+  room_members members; // local members of each room, only used by the shard's thread
+  mpmc_queue mailbox;   // chat_msg* from other shards
+  // clients with a full outbox, by policy
+  atomic_long dropped_oldest, dropped_new, disconnects;
+} shard;
 
-/* Read at most 512 byte line from client.
- * Returns true if line was read, false if not ready yet. */
-bool participant_read_line(conn_state *c, char *to) {
-  participant *p = (participant*)c->data;
-  int r = recv(c->socket, &p->msg[p->read_pos], 512 - p->read_pos, MSG_DONTWAIT);
-  if(r == 0) {
-    dbg("Read 0, closing socket.");
-    close(c->socket);
-    c->socket = 0;
+int num_shards;
+shard shards[SERVER_MAX_REACTORS];
+
+// interned room name -> room, rooms are never removed
+DefineHashMap(room_map, const char *, room *, hm_hash_int, hm_int_eq);
+room_map rooms;
+rwlock rooms_lock;
+
+room *get_room(const char *name) {
+  room *r = NULL;
+  reading(rooms_lock) {
+    r = room_map_get(&rooms, name, NULL);
+  }
+  if(r) return r;
+  writing(rooms_lock) {
+    // check again, another shard may have created it meanwhile
+    r = room_map_get(&rooms, name, NULL);
+    if(!r) {
+      r = calloc(1, sizeof(room));
+      if(r) {
+        r->name = name;
+        room_map_put(&rooms, name, r);
+      }
+    }
+  }
+  return r;
+}
+
+void chat_stats(FILE *out) {
+  long oldest = 0, new = 0, disconnects = 0;
+  for(int i = 0; i < num_shards; i++) {
+    oldest += atomic_load(&shards[i].dropped_oldest);
+    new += atomic_load(&shards[i].dropped_new);
+    disconnects += atomic_load(&shards[i].disconnects);
+  }
+  fprintf(out, "Full outboxes: %ld oldest dropped, %ld new dropped, %ld disconnects\n",
+          oldest, new, disconnects);
+}
+
+/* Returns false if out of memory, the message is then dropped */
+static bool outbox_push(outbox *o, const char *data, size_t len) {
+  if(!o->msgs) o->msgs = calloc(outbox_max, sizeof(pending_msg));
+  char *copy = o->msgs ? slab_buf_alloc(len) : NULL;
+  if(!copy) {
+    err("Could not queue message");
     return false;
   }
-  p->read_pos += r;
-  char *line_end = strchr(p->msg, '\n');
-  if(line_end) {
-    // got line end
-    *line_end = 0;
-    strcpy(to, p->msg);
-    // FIXME: there might be data after the newline from client
-    // should copy it, depends on how client flushes
-    p->read_pos = 0;
-    return true;
-  }
-  return false; // new newline encountered yet
-}
-
-/* broadcast to all other connections that are in CHATTING state*/
-void broadcast(conn_state *from, uint8_t *data, size_t len) {
-  each_conn_data(from, other_conn, participant*, pt, {
-      if(pt->state == PS_CHATTING) {
-        write(other_conn->socket, data, len);
+  memcpy(copy, data, len);
+  o->msgs[(o->head + o->count) % outbox_max] = (pending_msg) {copy, len};
+  o->count++;
+  return true;
+}
+
+static void outbox_pop(outbox *o) {
+  slab_buf_free(o->msgs[o->head].data, o->msgs[o->head].len);
+  o->head = (o->head + 1) % outbox_max;
+  o->count--;
+  o->head_sent = 0;
+}
+
+static void outbox_free(outbox *o) {
+  while(o->count) outbox_pop(o);
+  free(o->msgs);
+  o->msgs = NULL;
+}
+
+/* Write to a participant without blocking, queue what it doesn't take */
+void participant_send(conn_state *c, const char *data, size_t len) {
+  participant *p = (participant*)c->data;
+  shard *sh = &shards[c->reactor];
+  outbox *o = &p->out;
+  if(p->closing) return;
+  if(o->count == 0) {
+    ssize_t w = send(c->socket, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(w == (ssize_t) len) return;
+    if(w < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) return; // gone, reading will notice
+      w = 0;
+    }
+    if(outbox_push(o, data + w, len - w)) server_want_write(c, true);
+    else atomic_fetch_add(&sh->dropped_new, 1);
+    return;
+  }
+  if(o->count == outbox_max) {
+    switch(policy) {
+    case FULL_DROP_NEW:
+      if(atomic_fetch_add(&sh->dropped_new, 1) % 1024 == 0) chat_stats(stderr);
+      return;
+    case FULL_DROP_OLDEST:
+      if(atomic_fetch_add(&sh->dropped_oldest, 1) % 1024 == 0) chat_stats(stderr);
+      if(o->head_sent == 0) {
+        outbox_pop(o);
+      } else {
+        // first one is partially sent, drop the one after it
+        uint32_t next = (o->head + 1) % outbox_max;
+        slab_buf_free(o->msgs[next].data, o->msgs[next].len);
+        o->msgs[next] = o->msgs[o->head];
+        o->head = next;
+        o->count--;
       }
-    });
+      break;
+    case FULL_DISCONNECT:
+      atomic_fetch_add(&sh->disconnects, 1);
+      err("%s is too slow, disconnecting", p->name);
+      chat_stats(stderr);
+      // hangup makes it readable, the read that fails does the leaving
+      p->closing = true;
+      shutdown(c->socket, SHUT_RDWR);
+      return;
+    }
+  }
+  if(!outbox_push(o, data, len)) atomic_fetch_add(&sh->dropped_new, 1);
+}
+
+/* Socket is writable, send what is waiting */
+void participant_flush(conn_state *c) {
+  outbox *o = &((participant*)c->data)->out;
+  while(o->count) {
+    pending_msg *m = &o->msgs[o->head];
+    ssize_t w = send(c->socket, m->data + o->head_sent, m->len - o->head_sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(w < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+      outbox_free(o); // gone, reading will notice
+      break;
+    }
+    o->head_sent += w;
+    if(o->head_sent < m->len) return;
+    outbox_pop(o);
+  }
+  server_want_write(c, false);
+}
+
+void participant_close(conn_state *c) {
+  outbox_free(&((participant*)c->data)->out);
+  close(c->socket);
+  c->socket = 0;
+}
+
+/* Write data to all members of room on this shard, except one */
+void deliver_local(shard *sh, room *r, conn_state *except, const char *data, size_t len) {
+  room_members_entry *e = room_members_getp(&sh->members, r);
+  if(!e) return;
+  for(uint32_t i = 0; i < e->value.size; i++) {
+    conn_state *c = e->value.items[i];
+    if(c != except) participant_send(c, data, len);
+  }
+}
+
+/* Deliver everything in the mailbox of this shard */
+void chat_wakeup(int id) {
+  shard *sh = &shards[id];
+  chat_msg *m;
+  while(mpmc_pop(&sh->mailbox, &m)) {
+    deliver_local(sh, m->room, NULL, m->data, m->len);
+    if(atomic_fetch_sub(&m->refs, 1) == 1) free(m);
+  }
 }
 
+/* Send to all members of room except the sender */
+void room_send(conn_state *from, room *r, const char *data, size_t len) {
+  int self = from->reactor;
+  deliver_local(&shards[self], r, from, data, len);
+  uint64_t others = atomic_load(&r->shards) & ~(1ull << self);
+  if(!others) return;
+
+  chat_msg *m = malloc(sizeof(chat_msg) + len);
+  if(!m) {
+    err("Could not allocate message to other shards");
+    return;
+  }
+  atomic_init(&m->refs, __builtin_popcountll(others));
+  m->room = r;
+  m->len = len;
+  memcpy(m->data, data, len);
+  for(; others; others &= others - 1) {
+    int to = __builtin_ctzll(others);
+    while(!mpmc_push(&shards[to].mailbox, &m)) {
+      // full, let it catch up. Empty our own mailbox meanwhile in case
+      // that shard is waiting for us in the same way.
+      server_wake(to);
+      chat_wakeup(self);
+      sched_yield();
+    }
+    server_wake(to);
+  }
+}
+
+void room_join(conn_state *c, room *r) {
+  participant *p = (participant*)c->data;
+  shard *sh = &shards[c->reactor];
+  room_members_entry *e = room_members_getp(&sh->members, r);
+  if(!e) e = room_members_put(&sh->members, r, (conn_list) {0});
+  if(e->value.size == 0) atomic_fetch_or(&r->shards, 1ull << c->reactor);
+  p->member_idx = e->value.size;
+  da_append(&e->value, c);
+  p->room = r;
+
+  // roster of who is there, then add ourselves to it
+  char *out = NULL;
+  size_t len = 0;
+  locking(r->lock) {
+    static const char prefix[] = "* Chatting: ";
+    out = new_uninit(scratch(), char, sizeof(prefix) + r->roster.size + 1);
+    if(out) {
+      memcpy(out, prefix, sizeof(prefix) - 1);
+      if(r->roster.size) memcpy(out + sizeof(prefix) - 1, r->roster.items, r->roster.size);
+      len = sizeof(prefix) - 1 + r->roster.size;
+      out[len++] = '\n';
+    }
+
+    if(r->roster.size) da_append_n(&r->roster, ", ", 2);
+    da_append_n(&r->roster, p->name, strlen(p->name));
+  }
+  if(out) participant_send(c, out, len);
+  else err("Could not allocate roster for %s", p->name);
+}
+
+void room_leave(conn_state *c) {
+  participant *p = (participant*)c->data;
+  room *r = p->room;
+  room_members_entry *e = room_members_getp(&shards[c->reactor].members, r);
+  conn_list *members = &e->value;
+  // swap last member to our place
+  conn_state *last = members->items[--members->size];
+  members->items[p->member_idx] = last;
+  ((participant*)last->data)->member_idx = p->member_idx;
+  if(members->size == 0) atomic_fetch_and(&r->shards, ~(1ull << c->reactor));
+
+  // remove name and its separator from roster
+  size_t name_len = strlen(p->name);
+  locking(r->lock) {
+    char *roster = r->roster.items;
+    size_t size = r->roster.size;
+    for(size_t at = 0; at < size; ) {
+      char *sep = memchr(roster + at, ',', size - at);
+      size_t end = sep ? (size_t) (sep - roster) : size;
+      if(end - at == name_len && memcmp(roster + at, p->name, name_len) == 0) {
+        // take the following separator, or the preceding one for the last name
+        size_t from = at, to = end;
+        if(sep) to += 2;
+        else if(from > 0) from -= 2;
+        memmove(roster + from, roster + to, size - to);
+        r->roster.size -= to - from;
+        break;
+      }
+      at = end + 2;
+    }
+  }
+}
+
+/* Read what the client has sent, closes the connection on EOF or error */
+bool participant_read(conn_state *c) {
+  participant *p = (participant*)c->data;
+  if(line_reader_fill_nb(&p->in)) return true;
+  dbg("Read failed, closing socket.");
+  participant_close(c);
+  return false;
+}
+
+static bool valid_name(const char *n, size_t len) {
+  if(len == 0 || len > MAX_NAME) return false;
+  for(size_t i = 0; i < len; i++) {
+    if(!((n[i] >= 'a' && n[i] <= 'z') ||
+         (n[i] >= 'A' && n[i] <= 'Z') ||
+         (n[i] >= '0' && n[i] <= '9'))) return false;
+  }
+  return true;
+}
+
+/* Send all complete lines read so far to the room as one batch, so the
+ * other members get a single write and shards a single mailbox message */
+void participant_broadcast(conn_state *c) {
+  participant *p = (participant*)c->data;
+  size_t name_len = strlen(p->name);
+  // every line has at least its newline, each gets "[name] " added
+  size_t max = (p->in.end - p->in.start) * (name_len + 4);
+  char *out = new_uninit(scratch(), char, max);
+  size_t len = 0, line_len;
+  char *line;
+  if(!out) {
+    err("Could not allocate message batch for %s, dropping it", p->name);
+    while(line_reader_next(&p->in, NULL));
+    return;
+  }
+  while((line = line_reader_next(&p->in, &line_len))) {
+    dbg("chat BUF IS: \"%s\"", line);
+    out[len++] = '[';
+    memcpy(out + len, p->name, name_len);
+    len += name_len;
+    out[len++] = ']';
+    out[len++] = ' ';
+    memcpy(out + len, line, line_len);
+    len += line_len;
+    out[len++] = '\n';
+  }
+  if(len) room_send(c, p->room, out, len);
+}
 
 void chat_handler(conn_state *c) {
   participant *p = (participant*)c->data;
-  char buf[512], out[512];
-  switch(p->state) {
-  case PS_INITIAL: {
+  char buf[64];
+  if(c->events & SERVER_WRITABLE) participant_flush(c);
+  if(c->events && !(c->events & SERVER_READABLE)) return;
+  if(p->state == PS_INITIAL) {
     // new connection
-    write(c->socket, "Who dis?\n", 9);
+    p->in = (line_reader) {.socket = c->socket, .buf = p->in_buf, .size = IN_SIZE};
+    participant_send(c, "Who dis?\n", 9);
     p->state = PS_HELLO_SENT;
-    break;
-  }
-  case PS_HELLO_SENT:
-    // reading the name
-    if(participant_read_line(c, buf)) {
-      char *n = buf;
-      bool name_valid = true;
-      if(*n == 0) name_valid = false;
-      else {
-        while(*n) {
-          if(!((*n >= 'a' && *n <= 'z') ||
-               (*n >= 'A' && *n <= 'Z') ||
-               (*n >= '0' && *n <= '9'))) {
-            name_valid = false;
-            break;
-          }
-          n++;
-        }
-      }
-      if(!name_valid) {
-        dbg("Illegal name: %s", buf);
-        close(c->socket);
-        c->socket = 0;
-        return;
-      }
+    return;
+  }
 
-      strncpy(p->name, buf, 17);
-      p->state = PS_CHATTING;
-      // write who are the participants
-
-      size_t write_pos = snprintf(buf, 512, "* Chatting: ");
-      bool first = true;
-      each_conn_data(c, _c, participant*, pt, {
-          if(pt->state == PS_CHATTING) {
-            if(write_pos >= 510) {
-              err("Not enough space!");
-              return; // FIXME: what to do?
-            }
-            write_pos += snprintf(&buf[write_pos], 512-write_pos, "%s%s",
-                                  first ? "" : ", ", pt->name);
-            first = false;
-          }
-        });
-      write_pos += snprintf(&buf[write_pos], 512-write_pos, "\n");
-      write(c->socket, buf, write_pos);
-
-      // Send join notification to everyone chatting
-      size_t len = snprintf(buf, 512, "* %s joined\n", p->name);
-      broadcast(c, (uint8_t*)buf, len);
+  if(!participant_read(c)) {
+    if(p->state == PS_CHATTING) {
+      room_leave(c);
+      size_t len = snprintf(buf, sizeof(buf), "* %s left\n", p->name);
+      room_send(c, p->room, buf, len);
     }
-    break;
-  case PS_CHATTING:
-    if(participant_read_line(c, buf)) {
-      printf("chat BUF IS: \"%s\"\n", buf);
-      // send line to everyone
-      size_t len = snprintf(out, 512, "[%s] %s\n", p->name, buf);
-      broadcast(c, (uint8_t*)out, len);
-    } else if(c->socket == 0) {
-      // we just closed this
-      size_t len = snprintf(buf, 512, "* %s left\n", p->name);
-      broadcast(c, (uint8_t*) buf, len);
+    return;
+  }
+
+  if(p->state == PS_HELLO_SENT) {
+    // reading the name, optionally followed by @room
+    size_t len;
+    char *line = line_reader_next(&p->in, &len);
+    if(!line) return;
+    char *at = memchr(line, '@', len);
+    size_t name_len = at ? (size_t) (at - line) : len;
+    const char *room_name = at ? at + 1 : "";
+    if(!valid_name(line, name_len) || (at && !valid_name(room_name, strlen(room_name)))) {
+      dbg("Illegal name: %s", line);
+      participant_close(c);
+      return;
     }
+    memcpy(p->name, line, name_len);
+    p->name[name_len] = 0;
+    room *r = get_room(intern_cstr(room_name));
+    if(!r) {
+      err("Could not create room %s", room_name);
+      participant_close(c);
+      return;
+    }
+    p->state = PS_CHATTING;
+    room_join(c, r);
 
-    break;
+    // Send join notification to everyone chatting
+    len = snprintf(buf, sizeof(buf), "* %s joined\n", p->name);
+    room_send(c, r, buf, len);
+    // chat lines may have come along with the name
   }
+  participant_broadcast(c);
 }
 
 int main(int argc, char **argv) {
-  serve(.type = SERVER_SELECT,
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--policy=disconnect") == 0) policy = FULL_DISCONNECT;
+    else if(strcmp(argv[i], "--policy=drop-oldest") == 0) policy = FULL_DROP_OLDEST;
+    else if(strcmp(argv[i], "--policy=drop-new") == 0) policy = FULL_DROP_NEW;
+    else if(strncmp(argv[i], "--outbox=", 9) == 0) outbox_max = atoi(argv[i] + 9);
+    else {
+      err("Unknown option: %s", argv[i]);
+      return 1;
+    }
+  }
+  if(outbox_max < 2) outbox_max = 2;
+  // one reactor per core, each chatter takes a file descriptor
+  num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_shards < 1) num_shards = 1;
+  if(num_shards > SERVER_MAX_REACTORS) num_shards = SERVER_MAX_REACTORS;
+  for(int i = 0; i < num_shards; i++) {
+    if(!mpmc_init(&shards[i].mailbox, MAILBOX_SIZE, sizeof(chat_msg*))) {
+      err("Could not allocate mailbox");
+      return 1;
+    }
+  }
+  struct rlimit lim;
+  if(getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  serve(.type = SERVER_REACTOR,
+        .threads = num_shards,
+        .backlog = 1024,
         .connection_data_size = sizeof(participant),
-        .handler=chat_handler);
+        .handler = chat_handler,
+        .wakeup_handler = chat_wakeup);
 }
@@ -3,8 +3,10 @@
 #include "server.h"
 #define HASH_IMPLEMENTATION
 #include "hash.h"
+#define SLAB_IMPLEMENTATION
+#include "slab.h"
 
-#define HT_SIZE 4096
+#define HT_SIZE 4096 // power of 2, index is masked from the hash
 
 typedef struct KV {
   uint8_t *key;
@@ -51,7 +53,7 @@ void kv_database(dgram *d) {
   if(has_val) {
     // this is storage
     dbg("Store %.*s (%d) = %.*s (%d)", keylen, key, keylen, vallen, val, vallen);
-    long idx = hash(key, keylen) % HT_SIZE;
+    long idx = hash(key, keylen) & (HT_SIZE - 1);
 
     // go through bucket to find value
     bucket *b = &table[idx];
@@ -61,9 +63,9 @@ void kv_database(dgram *d) {
       if(b->items[i].keylen == keylen && memcmp(b->items[i].key,key,keylen)==0) {
         // overwrite
         dbg("Overwrite key \"%.*s\" with new value: \"%.*s\"", keylen, key, vallen, val);
-        free(b->items[i].val);
+        slab_buf_free(b->items[i].val, b->items[i].vallen);
         b->items[i].vallen = vallen;
-        b->items[i].val = malloc(vallen);
+        b->items[i].val = slab_buf_alloc(vallen);
         if(!b->items[i].val) {
           err("Out of memory");
           exit(1);
@@ -83,8 +85,8 @@ void kv_database(dgram *d) {
       }
       b->capacity = new_capacity;
     }
-    b->items[b->count] = (kv) {.key = malloc(keylen), .keylen = keylen,
-                                 .val = malloc(vallen), .vallen = vallen};
+    b->items[b->count] = (kv) {.key = slab_buf_alloc(keylen), .keylen = keylen,
+                                 .val = slab_buf_alloc(vallen), .vallen = vallen};
     if(!b->items[b->count].key || !b->items[b->count].val) {
       err("Failed to allocate new item");
       exit(1);
@@ -95,7 +97,7 @@ void kv_database(dgram *d) {
   } else {
     // this is query
     dbg("Query: \"%.*s\"", keylen, key);
-    long idx = hash(key, keylen) % HT_SIZE;
+    long idx = hash(key, keylen) & (HT_SIZE - 1);
     bucket b = table[idx];
     uint8_t buf[1024];
     memcpy(buf, key, keylen);
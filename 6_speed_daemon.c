@@ -1,14 +1,22 @@
 #include <math.h>
+#include <signal.h>
 #include <stdint.h>
 #include <string.h>
 #define SERVER_IMPLEMENTATION
 #include "server.h"
-#define ARENA_IMPLEMENTATION
-#define error err
-#include "arena.h"
 
-#define STB_DS_IMPLEMENTATION
-#include "stb/stb_ds.h"
+#define DYNARR_IMPLEMENTATION
+#include "dynarr.h"
+#define SLAB_IMPLEMENTATION
+#include "slab.h"
+#define HASH_IMPLEMENTATION
+#include "hashmap.h"
+#define INTERN_IMPLEMENTATION
+#include "intern.h"
+#define SYNC_IMPLEMENTATION
+#include "sync.h"
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
 
 #include <sys/time.h>
 #include <sys/ioctl.h>
@@ -25,7 +33,8 @@ bool read_str(arena *a, conn_state *c, char **to) {
     err("Could not read string length");
     return false;
   }
-  char *str = malloc(len+1);//new(a, char, len+1);
+  char *str = new_uninit(a, char, len+1);
+  if(!str) return false;
   str[len] = 0;
   if(recv(c->socket, str, len, MSG_WAITALL) < len) {
     err("Could not read str of len %d", len);
@@ -83,6 +92,8 @@ typedef struct Dispatcher {
   int socket; // for sending tickets
 } Dispatcher;
 
+DefineArray(DispatcherArray, Dispatcher);
+
 typedef struct Client {
   ClientType type;
   union {
@@ -96,23 +107,24 @@ typedef struct CarPos {
   u16 road, mile, limit;
 } CarPos;
 
-typedef struct DayTicket {
-  uint32_t key; // the day floot(ts/86400)
-  bool value;
-} DayTicket;
+// most cars are seen a few times and get at most a couple of tickets,
+// keep those inline in the car
+DefineSmallArray(CarPosArray, CarPos, 8);
+DefineSmallArray(DayArray, u32, 4);
 
 typedef struct Car {
-  CarPos *observations;
-  DayTicket *tickets;
+  CarPosArray observations; // sorted by road and ts
+  DayArray ticket_days; // days floor(ts/86400) a ticket has been sent for
 } Car;
 
-typedef struct CarMap {
-  char *key;
-  Car value;
-} CarMap;
+DefineSlab(car_slab, Car);
+
+// plate (interned, compared by pointer) -> car
+// cars are slab allocated, small arrays must not move
+DefineHashMap(CarMap, const char *, Car *, hm_hash_int, hm_int_eq);
 
 typedef struct Ticket {
-  char *plate;
+  const char *plate; // interned
   u16 road;
   u16 mile1;
   u32 ts1;
@@ -121,50 +133,48 @@ typedef struct Ticket {
   u16 speed;
 } Ticket;
 
+DefineArray(TicketArray, Ticket);
+DefineSmallArray(NewTickets, Ticket, 4);
+
+#define TICKET_QUEUE_SIZE 4096
 
 typedef struct SpeedDaemon {
   arena a;
-  pthread_mutex_t lock; // mutation lock
-  CarMap *car_table; // hashtable of cars (plate -> car)
-  Dispatcher *dispatchers;
-  Ticket *tickets; // pending tickets to send
+  mutex lock; // mutation lock
+  CarMap car_table; // hashtable of cars (plate -> car)
+  mutex dispatchers_lock;
+  DispatcherArray dispatchers;
+  mpmc_queue tickets; // new tickets for the sender thread, NULL plate is a wakeup
 } SpeedDaemon;
 
 SpeedDaemon state = {0};
 
-void lock(pthread_mutex_t *l) {
-  int c = 0;
-  while(pthread_mutex_trylock(l) != 0) {
-    usleep(100000);
-    c++;
-    if(c % 10 == 0)
-      dbg("Thread waiting on lock for %f seconds", c/10.0);
-  }
-}
-
-#define defer(name,start,end) for(int __##name = (start,0); !__##name; (__##name += 1), end)
-#define locking(state)                                                       \
-  defer(mutex, lock(&(state)->lock), pthread_mutex_unlock(&(state)->lock))
-
 // functions operating on state
 
-void init_state(SpeedDaemon *state) { pthread_mutex_init(&state->lock, NULL); }
-
-// sort by mile and road
-int compare_road_and_ts(const void *a, const void *b) {
-  CarPos *ca = (CarPos*) a, *cb = (CarPos*) b;
-  //dbg("compare (r: %d, ts: %d) with (r: %d, ts: %d)", ca->road, ca->ts, cb->road, cb->ts);
-  int rd = ca->road - cb->road;
-  if(rd == 0) {
-    return ca->ts - cb->ts;
-  } else {
-    return rd;
+bool has_ticket_for_day(Car *car, u32 day) {
+  for(u32 i=0; i<car->ticket_days.size; i++) {
+    if(car->ticket_days.items[i] == day) return true;
   }
+  return false;
 }
 
+// order by road and ts
+#define road_and_ts_less(a, b)                                                 \
+  ((a).road < (b).road || ((a).road == (b).road && (a).ts < (b).ts))
+
 
 
-void maybe_send_ticket(SpeedDaemon *state, Car *car, char *plate, CarPos a, CarPos b) {
+// Queue ticket for the sender thread. When the queue is full, wait for
+// the sender to catch up, a ticket is never dropped. Don't call with
+// state->lock held, cameras would wait on it meanwhile.
+void queue_ticket(SpeedDaemon *state, Ticket *t) {
+  while(!mpmc_push(&state->tickets, t)) sched_yield();
+}
+
+// Adds a ticket to out if a and b show speeding on a day the car has no
+// ticket for yet. The days count as ticketed right away, the caller
+// queues the ticket.
+void maybe_ticket(NewTickets *out, Car *car, const char *plate, CarPos a, CarPos b) {
   long speed = round(fabs(3600.0 * (b.mile-a.mile) / (b.ts-a.ts)));
   dbg("CHECK %s,  r: %d, m1: %d, ts1: %d,    m2: %d, ts2: %d,   speed %ld, limit %d", plate, a.road,
       a.mile, a.ts, b.mile, b.ts,
@@ -172,12 +182,10 @@ void maybe_send_ticket(SpeedDaemon *state, Car *car, char *plate, CarPos a, CarP
   uint32_t day1 = floor(a.ts/86400.0);
   uint32_t day2 = floor(b.ts/86400.0);
   if(speed > b.limit) {
-    if(hmget(car->tickets, day1) || hmget(car->tickets, day2)) {
+    if(has_ticket_for_day(car, day1) || has_ticket_for_day(car, day2)) {
       dbg("  ALREADY SENT for ticket to %s for day: %d - %d", plate, day1, day2);
     } else {
       dbg("  SENDING TICKET to %s for day: %d - %d", plate, day1, day2);
-      hmput(car->tickets, day1, true);
-      hmput(car->tickets, day2, true);
       Ticket t = (Ticket) {
         .plate = plate,
         .road = a.road,
@@ -187,86 +195,73 @@ void maybe_send_ticket(SpeedDaemon *state, Car *car, char *plate, CarPos a, CarP
         .ts2 = b.ts,
         .speed = speed
       };
-      arrput(state->tickets, t);
-
-      //send_ticket(state, car, a.road, a.mile, a.ts, b.mile, b.ts, speed);
+      da_append(out, t);
+      da_append(&car->ticket_days, day1);
+      if(day2 != day1) {
+        da_append(&car->ticket_days, day2);
+      }
     }
 
 
   }
 }
 
-void add_car_position(SpeedDaemon *state, char *plate, CarPos car_pos) {
-  locking(state) {
-
-    CarMap *cm = shgetp_null(state->car_table, plate);
-    if(cm == NULL) {
-      shput(state->car_table, plate, (Car){});
-      cm = shgetp_null(state->car_table, plate);
+void add_car_position(SpeedDaemon *state, const char *plate, CarPos car_pos) {
+  NewTickets tickets;
+  da_small_init(&tickets);
+  locking(state->lock) {
+
+    Car *car = CarMap_get(&state->car_table, plate, NULL);
+    if(car == NULL) {
+      car = slab_new(&car_slab, Car);
+      da_small_init(&car->observations);
+      da_small_init(&car->ticket_days);
+      CarMap_put(&state->car_table, plate, car);
     }
-    assert(cm != NULL);
-    Car *car = &cm->value;
 
-    arrput(car->observations, car_pos);
+    uint32_t at = da_insert_sorted(&car->observations, car_pos, road_and_ts_less);
 
-    // debug
-    dbg("Car with plate %s has following observations (%ld): ", plate, arrlen(car->observations));
-    qsort(car->observations, arrlen(car->observations), sizeof(CarPos), compare_road_and_ts);
-    for(int i=0;i<arrlen(car->observations);i++) {
-      CarPos obs = car->observations[i];
+#ifdef DEBUG
+    dbg("Car with plate %s has following observations (%u): ", plate, car->observations.size);
+    for(uint32_t i=0;i<car->observations.size;i++) {
+      CarPos obs = car->observations.items[i];
       dbg(" at time %d :: road: %d, mile: %d, limit: %d", obs.ts, obs.road, obs.mile, obs.limit);
     }
-
-    // Check for tickets
-    // we need to check between any 2 observations on the same road
-    int road = -1, i=0, start_idx = 0;
-    for(i=0;i<arrlen(car->observations); i++) {
-      CarPos p = car->observations[i];
-      //dbg("  i: %d, road: %d, start_idx : %d", i, p.road, start_idx);
-      if(p.road != road) {
-        if(i-start_idx > 0) {
-          dbg("checking tickets for road: %d", p.road);
-          // have 2 or more observations, check for tickets
-          for(int j=start_idx; j<i; j++) {
-            for(int k=j+1; k<i; k++) {
-              CarPos a = car->observations[j];
-              CarPos b = car->observations[k];
-              maybe_send_ticket(state, car, cm->key, a, b);
-            }
-          }
-        }
-        road = p.road;
-        start_idx = i;
-      }
-    }
-
-    // last batch
-    if(start_idx < arrlen(car->observations)-1) {
-      dbg("checking tickets for road: %d, start_idx=%d", car->observations[start_idx].road, start_idx);
-      for(int j=start_idx; j<arrlen(car->observations); j++) {
-        for(int k=j+1; k<arrlen(car->observations); k++) {
-          dbg(" compare obs %d with %d", j,k);
-          CarPos a = car->observations[j];
-          CarPos b = car->observations[k];
-          maybe_send_ticket(state, car, cm->key, a, b);
-        }
-      }
+#endif
+
+    // Check for tickets between the new observation and the others on the
+    // same road, all other pairs have already been checked.
+    CarPos key = { .road = car_pos.road };
+    uint32_t start = da_lower_bound(&car->observations, key, road_and_ts_less);
+    key.ts = UINT32_MAX;
+    uint32_t end = da_upper_bound(&car->observations, key, road_and_ts_less);
+    dbg("checking tickets for road: %d, observations %u - %u", car_pos.road, start, end);
+    for(uint32_t i=start; i<end; i++) {
+      if(i == at) continue;
+      CarPos a = car->observations.items[i < at ? i : at];
+      CarPos b = car->observations.items[i < at ? at : i];
+      maybe_ticket(&tickets, car, plate, a, b);
     }
 
   }
+  for(uint32_t i=0; i<tickets.size; i++) queue_ticket(state, &tickets.items[i]);
+  da_free(&tickets);
 }
 
 void add_dispatcher(SpeedDaemon *state, Dispatcher dispatcher) {
-  locking(state) {
-    arrput(state->dispatchers, dispatcher);
+  locking(state->dispatchers_lock) {
+    da_append(&state->dispatchers, dispatcher);
   }
+  // wake sender to retry tickets that had no dispatcher
+  Ticket wakeup = {0};
+  queue_ticket(state, &wakeup);
 }
 
 void remove_dispatcher(SpeedDaemon *state, Dispatcher dispatcher) {
-  locking(state) {
-    for(int i=0;i<arrlen(state->dispatchers);i++) {
-      if(state->dispatchers[i].socket == dispatcher.socket) {
-        arrdelswap(state->dispatchers, i);
+  locking(state->dispatchers_lock) {
+    for(uint32_t i=0;i<state->dispatchers.size;i++) {
+      if(state->dispatchers.items[i].socket == dispatcher.socket) {
+        state->dispatchers.items[i] = state->dispatchers.items[--state->dispatchers.size];
         break;
       }
     }
@@ -284,55 +279,55 @@ void remove_dispatcher(SpeedDaemon *state, Dispatcher dispatcher) {
 
 
 
-// Ticket sender thread
+// Send ticket to a dispatcher for its road, called with dispatchers_lock held.
+// Returns false if there is no dispatcher for the road.
+bool send_ticket(SpeedDaemon *state, Ticket t) {
+  for(uint32_t i=0; i<state->dispatchers.size; i++) {
+    Dispatcher d = state->dispatchers.items[i];
+    for(int r=0;r<d.numroads;r++) {
+      if(d.roads[r] != t.road) continue;
+      dbg("Sending to dispatcher %d (socket %d, road %d)", i, d.socket, t.road);
+      u8 buf[1+1+255+16];
+      u8 len = intern_len(t.plate);
+      u8 *at = buf;
+      *at++ = 0x21;
+      *at++ = len;
+      memcpy(at, t.plate, len); at += len;
+      u16 out = htons(t.road); memcpy(at, &out, 2); at += 2;
+      out = htons(t.mile1); memcpy(at, &out, 2); at += 2;
+      u32 out32 = htonl(t.ts1); memcpy(at, &out32, 4); at += 4;
+      out = htons(t.mile2); memcpy(at, &out, 2); at += 2;
+      out32 = htonl(t.ts2); memcpy(at, &out32, 4); at += 4;
+      out = htons(t.speed*100); memcpy(at, &out, 2); at += 2;
+      write(d.socket, buf, at - buf);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Ticket sender thread, sleeps until a ticket is queued or a dispatcher
+// connects. Tickets for roads without a dispatcher wait in pending.
 void ticket_sender(SpeedDaemon *state) {
-  // poll for new tickets
+  TicketArray pending;
+  da_init(&pending);
+  Ticket t;
   while(1) {
-    usleep(1000);
-    locking(state) {
-      int pending_tickets = arrlen(state->tickets);
-      if(pending_tickets) {
-        dbg("Pending tickets: %d", pending_tickets);
-        Ticket t = state->tickets[0];
-
-        Dispatcher to;
-        bool found=false;
-        dbg("Sending ticket, dispatchers: %ld", arrlen(state->dispatchers));
-        for(int i=0; i<arrlen(state->dispatchers);i++) {
-          Dispatcher d = state->dispatchers[i];
-          for(int r=0;r<d.numroads;r++) {
-            if(d.roads[r] == t.road) {
-              dbg("Sending to dispatcher %d (socket %d, road %d)", i, d.socket, t.road);
-              to = d;
-              found = true;
-            }
-          }
-        }
-        if(found) {
-          int len = strlen(t.plate);
-          char head[2] = { 0x21, len };
-          write(to.socket, &head, 2);
-          write(to.socket, t.plate, len);
-          uint16_t out = htons(t.road);
-          write(to.socket, &out, 2);
-          out = htons(t.mile1);
-          write(to.socket, &out, 2);
-          uint32_t out32 = htonl(t.ts1);
-          write(to.socket, &out32, 4);
-          out = htons(t.mile2);
-          write(to.socket, &out, 2);
-          out32 = htonl(t.ts2);
-          write(to.socket, &out32, 4);
-          out = htons(t.speed*100);
-          write(to.socket, &out, 2);
-          // remove this ticket, as we successfully sent it
-          arrdelswap(state->tickets, 0);
+    if(!mpmc_pop_wait(&state->tickets, &t, -1)) continue;
+    do {
+      if(t.plate) {
+        da_append(&pending, t);
+      }
+    } while(mpmc_pop(&state->tickets, &t));
+
+    dbg("Pending tickets: %u", pending.size);
+    locking(state->dispatchers_lock) {
+      for(uint32_t i=0; i<pending.size;) {
+        if(send_ticket(state, pending.items[i])) {
+          pending.items[i] = pending.items[--pending.size];
         } else {
-          // PENDING: do we need to try
           dbg("  couldn't send ticket yet, no dispatcher found!");
-          // swap this to last place
-          arrdel(state->tickets, 0);
-          arrput(state->tickets, t);
+          i++;
         }
       }
     }
@@ -344,7 +339,7 @@ void speed_daemon(conn_state *c) {
   arena a = {0};
   int heartbeat = 0; // heartbeat in ms
   long last_heartbeat = 0;
-  char *error; // send error to client
+  char *error = NULL; // send error to client
 
   while(1) {
     if(heartbeat > 0) {
@@ -372,9 +367,13 @@ void speed_daemon(conn_state *c) {
         error = "not a camera";
         goto fail;
       }
-      char *plate;
+      // raw plate is only needed for this message, cars and tickets
+      // use the interned copy
+      char *raw_plate;
       u32 ts;
-      if(!read_str(&a, c, &plate)) goto fail;
+      if(!read_str(scratch(), c, &raw_plate)) goto fail;
+      const char *plate = intern_cstr(raw_plate);
+      if(!plate) goto fail;
       READ(u32, ts);
       dbg("%d Plate: plate=%s, ts=%d", c->socket, plate, ts);
       add_car_position(&state, plate, (CarPos) {
@@ -437,6 +436,8 @@ void speed_daemon(conn_state *c) {
       error = "Unrecognized message";
       goto fail;
     }
+    // message handled, release its temporary allocations
+    scratch_reset();
   }
  fail:
   if(error) {
@@ -454,15 +455,18 @@ void speed_daemon(conn_state *c) {
   if(client.type == DISPATCHER) {
     remove_dispatcher(&state, client.data.dispatcher);
   }
+  // dispatcher roads live in the arena, free only after removing it
+  arena_free(&a);
   dbg("client done");
 }
 
 
 int main(int argc, char **argv) {
-  sh_new_strdup(state.car_table);
-
-  pthread_mutex_init(&state.lock, NULL);
-
+  da_init(&state.dispatchers);
+  if(!mpmc_init(&state.tickets, TICKET_QUEUE_SIZE, sizeof(Ticket))) {
+    err("Couldn't allocate ticket queue");
+    return 1;
+  }
   pthread_t ticket_thread;
   pthread_create(&ticket_thread, NULL, (void*)ticket_sender, &state);
 
@@ -3,8 +3,16 @@
 #define SERVER_IMPLEMENTATION
 #include "server.h"
 
-#define STB_DS_IMPLEMENTATION
-#include "stb/stb_ds.h"
+#define SLAB_IMPLEMENTATION
+#include "slab.h"
+#define HASH_IMPLEMENTATION
+#include "hashmap.h"
+#define STR_IMPLEMENTATION
+#include "str.h"
+#define SYNC_IMPLEMENTATION
+#include "sync.h"
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
 
 #include <sys/time.h>
 
@@ -14,18 +22,15 @@ typedef enum { RECEIVING, SENDING } SessionState;
 typedef struct Session {
   SessionState state;
   // data for receiving
-  int received, received_acked, bytes_available, read_idx;
-  uint8_t *rcv_buf;
+  int received, received_acked;
+  spsc_queue rcv; // bytes from the datagram handler to the reverser thread
   uint8_t *snd_buf;
 
   long last_msg_time; // for detecting timeout
 
-  pthread_mutex_t read_lock;
-  pthread_cond_t read_available;
-
   // data for sending
-  pthread_mutex_t write_lock;
-  pthread_cond_t write_available;
+  mutex write_lock;
+  condvar write_available;
   int sent, sent_acked, write_idx;
   long last_sent_time;
 
@@ -36,15 +41,7 @@ typedef struct Session {
   FILE *log;
 } Session;
 
-typedef struct SessionMap {
-  int key;
-  Session *value;
-} SessionMap;
-
-typedef struct str {
-  ptrdiff_t len;
-  char *data;
-} str;
+DefineHashMap(SessionMap, uint32_t, Session *, hm_hash_int, hm_int_eq);
 
 /* current time in millis */
 long now() {
@@ -53,48 +50,22 @@ long now() {
   return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
-bool split(str in, char sep, str *part1, str *rest) {
-  int p=0;
-  while(p < in.len && in.data[p] != sep) p++;
-  if(p == in.len) return false;
-  *part1 = (str) { .len = p, .data = in.data };
-  *rest = (str) { .len = in.len - p -1 , .data = in.data+p+1};
-  return true;
-}
-
-// split all, allocs a new dynamic array
-str *split_all(str in, char sep) {
-  str *parts = NULL;
-  str part, rest;
-  while(split(in, sep, &part, &rest)) {
-    arrput(parts, part);
-    in = rest;
-  }
-  // last part
-  if(in.len)
-    arrput(parts, in);
-  return parts;
-}
+// Shared by the datagram handler and the sender thread. Take it before
+// a session's write_lock, never while holding one.
+SessionMap sessions;
+mutex sessions_lock;
 
-bool str_eq(str a, str b) {
-  if(a.len != b.len) return false;
-  return memcmp(a.data,b.data,a.len)==0;
-}
-#define cstr(X)                                                                \
-  (str) { .data = (X), .len = strlen((X)) }
-
-bool str_to_u32(str in, uint32_t *to) {
-  uint32_t n = 0;
-  for(int i=0;i<in.len;i++) {
-    char c = in.data[i];
-    if(c < '0' || c > '9') return false;
-    n = n * 10 + (c - '0');
+void session_remove(uint32_t key) {
+  locking(sessions_lock) {
+    SessionMap_del(&sessions, key);
   }
-  *to = n;
-  return true;
 }
 
-SessionMap *sessions;
+// sessions with their receive and send buffers
+#define RCV_SIZE 65536
+#define SND_SIZE 64000
+#define SESSION_BUFFERS (RCV_SIZE + SND_SIZE)
+slab session_slab = SLAB_INIT("Session", sizeof(Session) + SESSION_BUFFERS);
 
 void session_send(Session *s, str data, int line) {
   fprintf(s->log, ">> (%d) %.*s\n", (int) data.len, (int) data.len, data.data);
@@ -109,42 +80,14 @@ void dgram_send(dgram *dg, str data, int line) {
 #define SEND(s, fmt, ...) session_send((s), (str) {.data=out, .len=snprintf(out, 1024, fmt, __VA_ARGS__)}, __LINE__)
 #define SENDD(d, fmt, ...) dgram_send((d), (str) {.data=out, .len=snprintf(out, 1024, fmt, __VA_ARGS__)}, __LINE__)
 
-void lock(pthread_mutex_t *l) {
-  int c = 0;
-  while(pthread_mutex_trylock(l) != 0) {
-    usleep(100000);
-    c++;
-    if(c % 10 == 0)
-      dbg("Thread waiting on lock for %f seconds", c/10.0);
-  }
-}
-
-#define defer(name,start,end) for(int __##name = (start,0); !__##name; (__##name += 1), end)
-#define locking(lck)                                                       \
-  defer(mutex, lock(&(lck)), pthread_mutex_unlock(&(lck)))
-
-void ensure_all_handled(Session *s) {
-  while(s->bytes_available) {
-    locking(s->read_lock) {
-      pthread_cond_signal(&s->read_available);
-    }
-  }
-}
-
 
 // interface given to app level
 typedef Session* IO;
 
 int io_getchar(IO io) {
-  // wait until there are
-  int ch = -1;
-  locking(io->read_lock) {
-    while(io->read_idx == io->received) {
-      pthread_cond_wait(&io->read_available, &io->read_lock);
-    }
-    ch = io->rcv_buf[io->read_idx++];
-    //dbg("read char: %c", ch);
-  }
+  // wait until there is something received
+  uint8_t ch;
+  spsc_pop_wait(&io->rcv, &ch, 1, -1);
   return ch;
 }
 
@@ -199,14 +142,14 @@ void line_reversal(dgram *dg) {
   }
   str message = (str){.data=(char*)&dg->data[1], .len=dg->len-1};
   str cmd, rest;
-  if(!split(message, '/', &cmd, &rest)) {
+  if(!str_split(message, '/', &cmd, &rest)) {
     err("Could not split command from message");
     return;
   }
 
   uint32_t key;
   str key_str;
-  if(!split(rest, '/', &key_str, &rest)) {
+  if(!str_split(rest, '/', &key_str, &rest)) {
     err("Could not split session");
     return;
   }
@@ -215,17 +158,22 @@ void line_reversal(dgram *dg) {
     return;
   }
 
-  if(!str_eq(cmd, cstr("connect")) && hmgeti(sessions,key) < 0) {
+  Session *s = NULL;
+  locking(sessions_lock) {
+    s = SessionMap_get(&sessions, key, NULL);
+  }
+  if(!str_eq(cmd, cstr("connect")) && !s) {
     dbg("No session found: %d", key);
     SENDD(dg, "/close/%d/", key);
     return;
   }
 
-  Session *s = hmget(sessions,key);
   if(s) {
     fprintf(s->log, "<< (%d) %.*s\n", dg->len, dg->len, dg->data);
     fflush(s->log);
-    s->last_msg_time = now();
+    locking(s->write_lock) {
+      s->last_msg_time = now(); // the sender checks it for timeouts
+    }
   }
   if(str_eq(cmd, cstr("connect"))) {
     dbg("Connect from: %d:%d, session id: %d", dg->from->sin_addr.s_addr, dg->from->sin_port,
@@ -235,15 +183,15 @@ void line_reversal(dgram *dg) {
       SEND(s, "/ack/%d/%d/", key, s->received);
       return;
     }
-    s = calloc(1, sizeof(Session) + 128000);
+    s = slab_new(&session_slab, Session);
     if(!s) {
       err("Could not allocate new session!");
       return;
     }
     s->from = *dg->from;
     s->socket = dg->socket;
-    s->rcv_buf = (uint8_t*) s + sizeof(Session);
-    s->snd_buf = s->rcv_buf + 64000;
+    spsc_init_buf(&s->rcv, (uint8_t*) s + sizeof(Session), RCV_SIZE, 1);
+    s->snd_buf = (uint8_t*) s + sizeof(Session) + RCV_SIZE;
     s->last_msg_time = now();
 
     char filename[64];
@@ -252,17 +200,15 @@ void line_reversal(dgram *dg) {
     fprintf(s->log, "<< (%d) %.*s\n", dg->len, dg->len, dg->data);
     fflush(s->log);
 
-    pthread_cond_init(&s->read_available, NULL);
-    pthread_mutex_init(&s->read_lock, NULL);
-    pthread_cond_init(&s->write_available, NULL);
-    pthread_mutex_init(&s->write_lock, NULL);
     pthread_t tid;
     pthread_create(&tid, NULL, (void*)reverser, s);
     SEND(s, "/ack/%d/%d/", key, s->received);
-    hmput(sessions, key, s);
+    locking(sessions_lock) {
+      SessionMap_put(&sessions, key, s);
+    }
   } else if(str_eq(cmd, cstr("data"))) {
     str pos_str;
-    if(!split(rest, '/', &pos_str, &rest)) {
+    if(!str_split(rest, '/', &pos_str, &rest)) {
       err("Could not split position for data command");
       return;
     }
@@ -276,78 +222,78 @@ void line_reversal(dgram *dg) {
     if(s->received - pos > 0) {
       SEND(s, "/ack/%d/%d/", key, s->received);
     } else {
-      // Read the data
+      // Read the data, copying runs between escapes
+      if(rest.len < 1 || rest.data[rest.len-1] != '/') {
+        err("Message doesn't end in '/'");
+        return;
+      }
       char data[1024];
       size_t data_len=0;
-      int i=0;
-      while(i < rest.len-1) {
-        if(rest.data[i] == '\\') {
-          if(rest.data[i+1] == '/') {
-            data[data_len++] = '/';
-            i += 2;
-            continue;
-          } else if(rest.data[i+1] == '\\') {
-            data[data_len++] = '\\';
-            i += 2;
-            continue;
-          } else {
-            dbg("Unknown escape code '%c', ignoring packet.", rest.data[i+1]);
-            return;
-          }
-        } else if (rest.data[i] == '/') {
+      str body = { .len = rest.len-1, .data = rest.data };
+      while(body.len > 0) {
+        ptrdiff_t at = str_find_any(body, cstr("\\/"));
+        ptrdiff_t run = at < 0 ? body.len : at;
+        memcpy(&data[data_len], body.data, run);
+        data_len += run;
+        if(at < 0) break;
+        if(body.data[at] == '/') {
           dbg("Unescaped '/' character, ignoring packet.");
           return;
-        } else {
-          data[data_len++] = rest.data[i++];
         }
+        if(at+1 == body.len) {
+          dbg("Escaped final '/', ignoring packet.");
+          return;
+        }
+        char escaped = body.data[at+1];
+        if(escaped != '/' && escaped != '\\') {
+          dbg("Unknown escape code '%c', ignoring packet.", escaped);
+          return;
+        }
+        data[data_len++] = escaped;
+        body.data += at+2;
+        body.len -= at+2;
       }
-      if(rest.data[i] != '/') {
-        err("Message doesn't end in '/', got: %c", rest.data[i]);
-        return;
-      }
-
 
-      // wait until everything has been handled
-
-      //ensure_all_handled(s);
-      locking(s->read_lock) {
-        memcpy(&s->rcv_buf[s->received], data, data_len);
-        s->received += data_len;
-        s->bytes_available += data_len;
-        dbg("making %ld bytes available for app level: \"%.*s\"", data_len, (int) data_len, s->rcv_buf);
-        pthread_cond_signal(&s->read_available);
-      }
+      // only ack what fits, the peer retransmits the rest
+      size_t pushed = spsc_push_n(&s->rcv, data, data_len);
+      s->received += pushed;
+      dbg("made %ld of %ld bytes available for app level", pushed, data_len);
 
       SEND(s, "/ack/%d/%d/", key, s->received);
 
     }
   } else if(str_eq(cmd, cstr("ack"))) {
     str pos_str;
-    if(!split(rest, '/', &pos_str, &rest)) {
+    if(!str_split(rest, '/', &pos_str, &rest)) {
       err("Could not split position for ack command");
       return;
     }
     uint32_t pos;
-    str_to_u32(pos_str, &pos);
+    if(!str_to_u32(pos_str, &pos)) {
+      err("Could not parse ack position: %.*s", (int)pos_str.len, pos_str.data);
+      return;
+    }
 
+    bool bad_ack = false;
     locking(s->write_lock) {
       if(pos <= s->sent_acked) {
         dbg("Got earlier ack for pos %d (but already received higher %d), ignoring.", pos, s->sent_acked);
       } else if(pos > s->sent) {
         dbg("Got ack for more than we have sent %d (only sent %d), ignoring.", pos, s->sent);
         SEND(s, "/close/%d/", key);
-        hmdel(sessions, key);
+        bad_ack = true;
       } else if(s->sent == pos) {
         s->sent_acked = pos;
       }
     }
+    if(bad_ack) session_remove(key);
 
 
   } else if(str_eq(cmd, cstr("close"))) {
     SEND(s, "/close/%d/", key);
     //fclose(s->log);
     //free(s);
-    hmdel(sessions, key);
+    session_remove(key);
   }
 
   //end:
@@ -359,16 +305,26 @@ void line_reversal(dgram *dg) {
 void sender() {
   char out[1024];
   while(1) {
-    for(int i=0;i<hmlen(sessions);i++) {
+    uint32_t i = 0;
+    while(1) {
+      // the map may change between sessions, only hold the lock to look
+      uint32_t key = 0;
+      Session *s = NULL;
+      locking(sessions_lock) {
+        if(i < sessions.len) {
+          key = sessions.entries[i].key;
+          s = sessions.entries[i].value;
+        }
+      }
+      if(!s) break;
       usleep(1000);
-      uint32_t key = sessions[i].key;
-      Session *s = sessions[i].value;
+      bool expired = false;
       locking(s->write_lock) {
         long n = now();
         if((n - s->last_msg_time) > 60000) {
           dbg("Closing inactive session: %d", key);
           SEND(s, "/close/%d/", key);
-          hmdel(sessions, key);
+          expired = true;
         } else if(s->write_idx > s->sent ||
                   (s->sent_acked < s->sent &&
                    (n - s->last_sent_time > RETRANSMISSION_TIMEOUT))) {
@@ -393,7 +349,11 @@ void sender() {
           s->sent = i;
         }
       }
+      // removing moves the last session to i, look at i again
+      if(expired) session_remove(key);
+      else i++;
     }
+    if(i == 0) usleep(1000); // no sessions
   }
 }
 
@@ -413,15 +373,13 @@ int main(int argc, char **argv) {
 
   str s = (str) { .len = 10, .data = "foo,barsky" };
   str foo, barsky;
-  if(split(s, ',', &foo, &barsky)) {
+  if(str_split(s, ',', &foo, &barsky)) {
     dbg("got: foo: %.*s, barsky: %.*s", (int) foo.len, foo.data, (int) barsky.len, barsky.data);
   }
 
   char *msg = "/data/666/420/hello world/";
-  str *parts = split_all((str){.len=strlen(msg),.data=msg}, '/');
-  dbg("got %ld parts", arrlen(parts));
-  for(int i=0;i<arrlen(parts);i++) {
-    str p = parts[i];
+  str in = cstr(msg), p;
+  for(int i=0;str_next(&in, '/', &p);i++) {
     dbg("part%d: %.*s", i, (int) p.len, p.data);
     }*/
 }
@@ -1,6 +1,8 @@
 #include <stdint.h>
 #define SERVER_IMPLEMENTATION
 #include "server.h"
+#define STR_IMPLEMENTATION
+#include "str.h"
 
 
 typedef uint32_t u32;
@@ -128,36 +130,18 @@ bool read_byte(conn_state *s, uint8_t *to) {
   return true;
 }
 
-typedef struct str {
-  ptrdiff_t len;
-  char *data;
-} str;
-
-bool split(str in, char sep, str *part1, str *rest) {
-  if(in.len == 0) return false;
-  int p=0;
-  while(p < in.len && in.data[p] != sep) p++;
-  if(p == in.len) {
-    *part1 = in;
-    *rest = (str) {.len = 0, .data = NULL };
-  } else {
-    *part1 = (str) { .len = p, .data = in.data };
-    *rest = (str) { .len = in.len - p -1 , .data = in.data+p+1};
-  }
-  return true;
-}
-
 str handle_line(str line) {
   dbg("GOT LINE: %.*s", (int) line.len, line.data);
-  int how_many = -1;
+  long how_many = -1;
   str result;
 
   str part, rest=line;
-  while(split(rest, ',', &part, &rest)) {
+  while(str_next(&rest, ',', &part)) {
     dbg("GOT PART: %.*s", (int) part.len, part.data);
-    int n = 0;
-    for(int i=0;i<part.len && part.data[i] != 'x'; i++)
-      n = n * 10 + (part.data[i] - '0');
+    // "10x toy car"
+    ptrdiff_t x = str_find(part, 'x');
+    uint32_t n;
+    if(x < 0 || !str_to_u32((str){.len = x, .data = part.data}, &n)) continue;
     dbg(" times: %d", n);
     if(how_many < n) {
       how_many = n;
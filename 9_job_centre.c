@@ -4,13 +4,30 @@
 #define JSON_IMPLEMENTATION
 #include "json.h"
 
-#define STB_DS_IMPLEMENTATION
-#include "stb/stb_ds.h"
+#define SLAB_IMPLEMENTATION
+#include "slab.h"
+
+#define DYNARR_IMPLEMENTATION
+#include "dynarr.h"
+
+#define HASH_IMPLEMENTATION
+#include "hashmap.h"
+
+#define INTERN_IMPLEMENTATION
+#include "intern.h"
+
+#define SYNC_IMPLEMENTATION
+#include "sync.h"
+
+#include <signal.h>
 
 // 16k buffer for both reading and response,
 // should fit the request and response, increase if not
 #define BUF_SIZE 16384
 
+// max pipelined requests handled before flushing responses
+#define MAX_BATCH 64
+
 typedef struct job {
   char *payload;
   long priority;
@@ -23,7 +40,7 @@ typedef enum { UNKNOWN=0, GET, PUT, DELETE, ABORT } rq_type;
 
 typedef struct rq_queues {
   int num_queues;
-  char *queues[MAX_QUEUES];
+  const char *queues[MAX_QUEUES]; // interned
 } rq_queues;
 
 typedef struct rq_get {
@@ -36,7 +53,7 @@ typedef struct rq_delete {
 } rq_delete;
 
 typedef struct rq_put {
-  char *queue;
+  const char *queue; // interned
   long priority;
   char *payload;
   size_t payload_size;
@@ -57,52 +74,34 @@ typedef struct rq {
 
 } rq;
 
+DefineArray(job_heap, job);
+
+// max heap by priority, highest priority job is first
+#define job_priority_less(a, b) ((a).priority < (b).priority)
+
 typedef struct queue {
-  job *jobs;
-  pthread_mutex_t lock; // lock for any operation
-  pthread_cond_t job_available; // for waiting on a job
+  job_heap jobs;
+  mutex lock; // lock for any operation
+  condvar job_available; // for waiting on a job
 } queue;
 
-typedef struct queue_map {
-  char *key;
-  queue *value;
-} queue_map;
+// queue name (interned, compared by pointer) -> queue
+DefineHashMap(queue_map, const char *, queue *, hm_hash_int, hm_int_eq);
 
 typedef enum { JOB_UNKNOWN = 0, JOB_QUEUED, JOB_IN_PROGRESS, JOB_DONE } job_status;
 
-typedef struct job_status_map {
-  long key;
-  job_status value;
-} job_status_map;
+DefineHashMap(job_status_map, long, job_status, hm_hash_int, hm_int_eq);
 
-pthread_mutexattr_t mutex_attr;
-pthread_mutex_t queues_lock, next_id_lock, job_status_lock;
-queue_map *queues;
-job_status_map *job_status_by_id;
+DefineSlab(queue_slab, queue);
 
-long next_id = 1;
-
-
-void lock(pthread_mutex_t *l, int LINE) {
-  int c = 0;
-  //  dbg("[LINE:%d] locking %p", LINE, l);
-  while(pthread_mutex_trylock(l) != 0) {
-    usleep(100000);
-    c++;
-    if(c % 10 == 0)
-      dbg("[LINE:%d] Thread waiting on lock %p for %f seconds", LINE, l, c/10.0);
-  }
-}
-void unlock(pthread_mutex_t *l, int LINE) {
-  //  dbg("[LINE:%d] unlocked %p", LINE, l);
-  pthread_mutex_unlock(l);
-}
+rwlock queues_lock; // read to look up queues, write to add
+mutex next_id_lock, job_status_lock;
+queue_map queues;
+job_status_map job_status_by_id;
 
-#define defer(name,start,end) for(int __##name = (start,0); !__##name; (__##name += 1), end)
-#define locking(lck)                                                       \
-  defer(mutex, lock(&(lck),__LINE__), unlock(&(lck),__LINE__))
+long next_id = 1;
 
-queue *get_queue(char *id) {
+queue *get_queue(const char *id) {
   if(!id) {
     err("Queue id can't be NULL!");
     return NULL;
@@ -110,23 +109,23 @@ queue *get_queue(char *id) {
   dbg("id ptr: %p", id);
   dbg("get_queue(\"%s\")", id);
   queue *ret=NULL;
-  locking(queues_lock) {
-    int idx = shgeti(queues, id);
-    if(idx == -1) {
+  reading(queues_lock) {
+    ret = queue_map_get(&queues, id, NULL);
+  }
+  if(ret) return ret;
+  writing(queues_lock) {
+    // check again, another thread may have created it meanwhile
+    ret = queue_map_get(&queues, id, NULL);
+    if(!ret) {
       // create new
       dbg("Creating new queue: %s", id);
-      ret = malloc(sizeof(queue));
+      ret = slab_new(&queue_slab, queue);
       if(!ret) {
         err("Unable to allocate new queue: %s", id);
       } else {
-        ret->jobs = NULL;
-
-        //pthread_cond_init(&ret->job_available, NULL);
-        pthread_mutex_init(&ret->lock, &mutex_attr);
-        shput(queues, id, ret);
+        da_init(&ret->jobs);
+        queue_map_put(&queues, id, ret);
       }
-    } else {
-      ret = queues[idx].value;
     }
   }
   return ret;
@@ -141,19 +140,13 @@ long get_next_id() {
   return id;
 }
 
-int compare_job_by_priority(job *a, job *b) {
-  return (int) (a->priority - b->priority);
-}
-
 job enqueue_job(queue *q, long priority, char *payload) {
   long id = get_next_id();
   job j = (job) {.payload=payload, .id=id, .priority=priority};
   dbg("enqueue id: %ld", id);
   locking(q->lock) {
-    arrput(q->jobs, j);
-    // PENDING: we could use a priority queue, but for now just quicksort
-    qsort(q->jobs, arrlen(q->jobs), sizeof(job), (void*)compare_job_by_priority);
-    dbg("job enqueued and sorted, len: %ld", arrlen(q->jobs));
+    da_heap_push(&q->jobs, j, job_priority_less);
+    dbg("job enqueued, len: %u", q->jobs.size);
   }
   return j;
 }
@@ -161,9 +154,8 @@ job enqueue_job(queue *q, long priority, char *payload) {
 bool queue_peek(queue *q, job *j) {
   bool ok = false;
   locking(q->lock) {
-    int l = arrlen(q->jobs);
-    if(l) {
-      *j = q->jobs[l-1];
+    if(q->jobs.size) {
+      *j = da_heap_top(&q->jobs);
       ok = true;
     }
   }
@@ -174,13 +166,13 @@ bool queue_take(queue *q, job *to, long expected_id, long expected_priority) {
   bool ret = false;
   locking(q->lock) {
     dbg("queue_take locked!");
-    if(arrlen(q->jobs)) {
-      dbg("there are %ld jobs", arrlen(q->jobs));
-      job j = arrlast(q->jobs);
+    if(q->jobs.size) {
+      dbg("there are %u jobs", q->jobs.size);
+      job j = da_heap_top(&q->jobs);
       if(j.id == expected_id && j.priority == expected_priority) {
-        *to = arrpop(q->jobs);
+        *to = da_heap_pop(&q->jobs, job_priority_less);
         ret = true;
-        dbg("GOT THE JOB: id=%ld, queue jobs left: %ld", to->id, arrlen(q->jobs));
+        dbg("GOT THE JOB: id=%ld, queue jobs left: %u", to->id, q->jobs.size);
       }
     }
   }
@@ -188,7 +180,7 @@ bool queue_take(queue *q, job *to, long expected_id, long expected_priority) {
   return ret;
 }
 
-bool dequeue_job(rq_queues requested_queues, bool wait, job *out, char **qname) {
+bool dequeue_job(rq_queues requested_queues, bool wait, job *out, const char **qname) {
   // get all queues
   int num_qs=requested_queues.num_queues;
   queue *qs[num_qs]; // stack allocation
@@ -236,7 +228,9 @@ bool parse_queues(char **json, rq_queues *q) {
   q->num_queues = 0;
 #define json_array_append(X) do { \
     if(q->num_queues == MAX_QUEUES) { err("Too many queues"); return false; } \
-    q->queues[q->num_queues++] = (X);                                   \
+    const char *_name = intern_cstr(X);                                 \
+    if(!_name) return false;                                            \
+    q->queues[q->num_queues++] = _name;                                 \
   } while(false)
 
   json_array(json, char*, json_string_ptr);
@@ -244,28 +238,28 @@ bool parse_queues(char **json, rq_queues *q) {
 #undef json_array_append
 }
 
-/* Parse and validate the request, returns true if request is valid. */
+/* Parse and validate the request, returns true if request is valid.
+ * Strings and the job payload point into data, nothing is allocated. */
 bool parse_request(rq *r, char *data) {
   char **json = &data;
-  char type[64] = {0};
-  char *queue;
+  json_slice type = {0}, payload = {0};
+  char *queue = NULL;
   rq_queues queues = {.num_queues = 0};
   long id = -1, priority = -1;
   bool wait = false;
-  char *payload;
   memset(r, 0, sizeof(rq));
 
   json_object(json, {
-      json_field("request", json_string_64, type);
+      json_field("request", json_string_slice, &type);
       json_field("queues", parse_queues, &queues);
       json_field("queue", json_string_ptr, &queue);
       json_field("id", json_long, &id);
       json_field("pri", json_long, &priority);
       json_field("wait", json_bool, &wait);
-      json_field("job", json_raw, &payload);
+      json_field("job", json_raw_slice, &payload);
       json_ignore_unknown_fields();
     });
-  if(strcmp(type, "get") == 0) {
+  if(json_slice_eq(type, "get")) {
     r->type = GET;
     if(queues.num_queues == 0) {
       err("Expected queues in GET request");
@@ -273,12 +267,13 @@ bool parse_request(rq *r, char *data) {
     }
     r->get.queues = queues;
     r->get.wait = wait;
-  } else if(strcmp(type, "put") == 0) {
+  } else if(json_slice_eq(type, "put")) {
     r->type = PUT;
-    r->put.payload = payload;
+    r->put.payload = payload.data;
+    r->put.payload_size = payload.len;
     r->put.priority = priority;
-    r->put.queue = queue;
-    if(!payload) {
+    r->put.queue = queue ? intern_cstr(queue) : NULL;
+    if(!payload.data) {
       err("No payload in PUT request");
       return false;
     }
@@ -286,19 +281,19 @@ bool parse_request(rq *r, char *data) {
       err("No priority in PUT request");
       return false;
     }
-    if(!queue) {
+    if(!r->put.queue) {
       err("No queue in PUT request");
       return false;
     }
     return true;
-  } else if(strcmp(type, "delete") == 0) {
+  } else if(json_slice_eq(type, "delete")) {
     r->type = DELETE;
     r->delete.job_id = id;
     if(id == -1) {
       err("No id in DELETE request");
       return false;
     }
-  } else if(strcmp(type, "abort") == 0) {
+  } else if(json_slice_eq(type, "abort")) {
     r->type = ABORT;
     r->abort.job_id = id;
     if(id == -1) {
@@ -306,7 +301,7 @@ bool parse_request(rq *r, char *data) {
       return false;
     }
   } else {
-    err("Unrecognized request type: %s", type);
+    err("Unrecognized request type: %.*s", (int) type.len, type.data);
     return false;
   }
   return true;
@@ -322,7 +317,7 @@ void print_request(rq *r) {
     printf("], wait? %s\n", r->get.wait ? "true" : "false");
     break;
   case PUT:
-    printf("PUT priority=%ld, payload=%s\n", r->put.priority, r->put.payload);
+    printf("PUT priority=%ld, payload=%.*s\n", r->put.priority, (int) r->put.payload_size, r->put.payload);
     break;
   case ABORT:
     printf("ABORT job_id=%ld\n", r->abort.job_id);
@@ -336,47 +331,46 @@ void print_request(rq *r) {
 
 void set_job_status(long id, job_status status) {
   locking(job_status_lock) {
-    hmput(job_status_by_id, id, status);
+    job_status_map_put(&job_status_by_id, id, status);
   }
 }
 
 job_status get_job_status(long id) {
   job_status ret;
   locking(job_status_lock) {
-    ret = hmget(job_status_by_id, id);
+    ret = job_status_map_get(&job_status_by_id, id, JOB_UNKNOWN);
   }
   return ret;
 }
 
-bool read_rq(conn_state *s, char *buf, rq *r) {
-  size_t line_pos = 0;
-  int ch;
-  while((ch = readch(s->socket)) != -1) {
-    if(line_pos == BUF_SIZE) {
-      err("Too large input, over %d bytes!", BUF_SIZE);
-      return false;
-    }
-    if(ch == '\n') {
-      buf[line_pos] = 0;
-      dbg("<< %s", buf);
-      if(parse_request(r, buf)) {
+/* Get the next valid request from buffered input, replying to invalid ones.
+ * Pipelined requests are answered in batches: responses are flushed when we
+ * need to block for more input, or after MAX_BATCH requests. */
+bool read_rq(line_reader *lr, write_buffer *wb, int *batch, rq *r) {
+  char *line;
+  while(1) {
+    while((line = line_reader_next(lr, NULL))) {
+      if(++*batch > MAX_BATCH) {
+        wbuf_flush(wb);
+        *batch = 1;
+      }
+      dbg("<< %s", line);
+      if(parse_request(r, line)) {
         return true;
-      } else {
-        // got invalid request, try again
-        err("Invalid request or handling error");
-        char *response = "{\"status\":\"error\"}\n";
-        send(s->socket, response, strlen(response), 0);
-        line_pos = 0;
       }
-    } else {
-      buf[line_pos++] = ch;
+      // got invalid request, try again
+      err("Invalid request or handling error");
+      char *response = "{\"status\":\"error\"}\n";
+      wbuf_write(wb, response, strlen(response));
     }
+    wbuf_flush(wb);
+    *batch = 0;
+    if(!line_reader_fill(lr)) return false;
   }
-  return false;
 }
 
 void job_centre(conn_state *s) {
-#define respond(fmt, ...) { rlen = snprintf(response,BUF_SIZE,fmt "\n" VA_ARGS(__VA_ARGS__)); if(rlen > BUF_SIZE) { err("too much data"); return; } send(s->socket, response, rlen, 0); }
+#define respond(fmt, ...) { if(!wbuf_printf(&wb, fmt "\n" VA_ARGS(__VA_ARGS__))) { err("too much data"); return; } }
 
   struct timeval tv;
   tv.tv_sec = 60;
@@ -386,28 +380,40 @@ void job_centre(conn_state *s) {
 
   char *buf = malloc(BUF_SIZE);
   char *response = malloc(BUF_SIZE);
-  size_t rlen;
   if(!buf || !response) {
     err("You sir, are out of memory!");
     return;
   }
+  line_reader lr = {.socket = s->socket, .buf = buf, .size = BUF_SIZE};
+  write_buffer wb = {.socket = s->socket, .buf = response, .size = BUF_SIZE};
+  int batch = 0;
   rq r;
   job working_on = {.id = -1};
-  char working_on_queue[64];
+  const char *working_on_queue = NULL;
 
-  while(read_rq(s, buf, &r)) {
+  while(read_rq(&lr, &wb, &batch, &r)) {
     switch(r.type) {
     case PUT: {
       queue *q = get_queue(r.put.queue);
       if(!q) return; // should not happen
-      job j = enqueue_job(q, r.put.priority, r.put.payload);
+      // payload points to the read buffer, copy it as the job outlives the request
+      char *payload = malloc(r.put.payload_size + 1);
+      if(!payload) {
+        err("Can't allocate job payload of %zu bytes", r.put.payload_size);
+        return;
+      }
+      memcpy(payload, r.put.payload, r.put.payload_size);
+      payload[r.put.payload_size] = 0;
+      job j = enqueue_job(q, r.put.priority, payload);
       respond("{\"status\":\"ok\",\"id\":%ld}", j.id);
       set_job_status(j.id, JOB_QUEUED);
       break;
     }
     case GET: {
-      char *qname;
+      const char *qname;
       job j;
+      // don't keep earlier responses waiting while we block
+      if(r.get.wait) wbuf_flush(&wb);
       if(!dequeue_job(r.get.queues, r.get.wait, &j, &qname)) {
         // no job found
         respond("{\"status\":\"no-job\"}");
@@ -421,7 +427,7 @@ void job_centre(conn_state *s) {
         respond("{\"status\":\"ok\",\"id\":%ld,\"job\":%s,\"pri\":%ld,\"queue\":\"%s\"}", j.id, j.payload, j.priority, qname);
         set_job_status(j.id, JOB_IN_PROGRESS);
         working_on = j;
-        strncpy(working_on_queue, qname, 64);
+        working_on_queue = qname;
       }
       break;
     }
@@ -446,18 +452,24 @@ void job_centre(conn_state *s) {
           working_on.id = -1;
           free(working_on.payload);
         } else {
-          locking(queues_lock) {
-            for(int i=0;i<shlen(queues); i++) {
-              queue_map *qm = &queues[i];
-              for(int j=0;j<arrlen(qm->value->jobs); j++) {
-                if(qm->value->jobs[j].id == r.delete.job_id) {
-                  dbg("Found %dth job with id %ld in queue %s to delete", j, qm->value->jobs[j].id, qm->key);
-                  arrdel(qm->value->jobs, j);
-                  goto done;
+          reading(queues_lock) {
+            bool deleted = false;
+            for(uint32_t i=0;i<queues.len && !deleted; i++) {
+              queue_map_entry *qm = &queues.entries[i];
+              job_heap *jobs = &qm->value->jobs;
+              // no goto out of locking, it would skip the unlock
+              locking(qm->value->lock) {
+                for(uint32_t j=0;j<jobs->size; j++) {
+                  if(jobs->items[j].id == r.delete.job_id) {
+                    dbg("Found %uth job with id %ld in queue %s to delete", j, jobs->items[j].id, qm->key);
+                    free(jobs->items[j].payload);
+                    da_heap_del(jobs, j, job_priority_less);
+                    deleted = true;
+                    break;
+                  }
                 }
               }
             }
-          done:
             dbg("delete done");
           }
         }
@@ -487,17 +499,6 @@ void job_centre(conn_state *s) {
 
 
 int main(int argc, char **argv) {
-  pthread_mutexattr_init(&mutex_attr);
-  pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK);
-
-  pthread_mutex_init(&queues_lock, NULL);
-  pthread_mutex_init(&next_id_lock, NULL);
-  pthread_mutex_init(&job_status_lock, NULL);
-  sh_new_strdup(queues);
-
-  hmdefault(job_status_by_id, JOB_UNKNOWN);
-
-
   // ignore lost write errors to lost connections
   signal(SIGPIPE, SIG_IGN);
 
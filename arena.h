@@ -1,25 +1,69 @@
 #ifndef arena_h
 #define arena_h
 #include <stdalign.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* == Arena allocator ==
+ * Memory is allocated from a chain of blocks, when the current block
+ * is full a new one (of at least double the size) is chained to it.
+ * Memory is never moved, pointers stay valid until clear/rewind/free.
+ *
+ * Blocks only reserve address space (mmap), pages are committed
+ * as the arena grows into them, so an arena costs what it uses.
+ * Default sized blocks of freed arenas are kept in a global pool
+ * and reused by the next arena.
+ *
+ * Define ARENA_HUGE_PAGES to back large blocks with transparent huge pages.
+ */
+typedef struct arena_block {
+  struct arena_block *prev; // previous (smaller) block in chain
+  size_t size;              // usable size after the header
+  uint8_t *commit;          // end of committed memory
+  size_t mapped;            // size of the whole mapping
+} arena_block;
 
-/* == Arena allocator == */
 typedef struct arena {
-  uint8_t *start;   // where allocated memory starts
+  uint8_t *start;   // where allocated memory starts (in current block)
   uint8_t *cur;     // current start of unused memory
-  uint8_t *end;     // start of memory after slab
+  uint8_t *end;     // start of memory after current block
+  arena_block *block; // current block
 } arena;
 
-#define ARENA_DEFAULT_SIZE (8 * 1024 * 1024) // 8mb default size
+/* Saved arena position, see arena_mark and arena_rewind */
+typedef struct arena_checkpoint {
+  arena_block *block;
+  uint8_t *cur;
+} arena_checkpoint;
+
+#define ARENA_DEFAULT_SIZE (64 * 1024 * 1024) // 64mb reserved, committed lazily
+#define ARENA_MAX_BLOCK_SIZE (1024L * 1024 * 1024) // stop doubling here
+#define ARENA_COMMIT_SIZE (64 * 1024) // commit granularity
+#define ARENA_POOL_MAX 256 // max free blocks kept for reuse
+#define ARENA_POOL_KEEP (64 * 1024) // committed bytes kept in pooled blocks
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_HUGE_PAGE_MIN (64 * 1024 * 1024) // blocks this big use huge pages
 
 #define new(arena, type, count)                                                \
   (type *)arena_alloc(arena, sizeof(type), alignof(type), count)
 
+/* Like new but memory is not zeroed */
+#define new_uninit(arena, type, count)                                         \
+  (type *)arena_alloc_uninit(arena, sizeof(type), alignof(type), count)
+
 
-/* Allocate memory with alignment */
+/* Allocate zeroed memory with alignment */
 void *arena_alloc(arena *arena, ptrdiff_t size, ptrdiff_t align,
                       ptrdiff_t count);
+
+/* Allocate memory with alignment, contents are undefined */
+void *arena_alloc_uninit(arena *arena, ptrdiff_t size, ptrdiff_t align,
+                         ptrdiff_t count);
+
 /* Initialize arena with given capacity */
 void arena_init(arena *arena, size_t capacity);
 
@@ -29,56 +73,252 @@ void arena_free(arena *arena);
 /* Clear arena so the memory can be reused */
 void arena_clear(arena *arena);
 
+/* Save current position, everything allocated after it can be
+ * released with arena_rewind. */
+arena_checkpoint arena_mark(arena *arena);
+
+/* Release everything allocated after the checkpoint was taken */
+void arena_rewind(arena *arena, arena_checkpoint cp);
+
 /* Copy string to arena */
 char *arena_str(arena *arena, char *str);
 #endif
 
-#ifdef ARENA_IMPLEMENTATION
-void *arena_alloc(arena *arena, ptrdiff_t size, ptrdiff_t align,
-                      ptrdiff_t count) {
-  if(!arena->start) {
+#if defined(ARENA_IMPLEMENTATION) && !defined(arena_implemented)
+#define arena_implemented
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define arena_error(fmt, ...) fprintf(stderr, "[ERROR] " fmt "\n", ##__VA_ARGS__)
+
+static struct {
+  pthread_mutex_t lock;
+  arena_block *free;
+  int count;
+} arena_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t arena_round_up(size_t n, size_t to) {
+  return (n + to - 1) & ~(to - 1);
+}
+
+static size_t arena_commit_size(arena_block *b) {
+#ifdef ARENA_HUGE_PAGES
+  if(b->size >= ARENA_HUGE_PAGE_MIN) return ARENA_HUGE_PAGE_SIZE;
+#else
+  (void) b;
+#endif
+  return ARENA_COMMIT_SIZE;
+}
+
+/* Make memory up to the given address usable */
+static bool arena_commit(arena_block *b, uint8_t *upto) {
+  if(upto <= b->commit) return true;
+  uint8_t *base = (uint8_t *) b;
+  size_t want = arena_round_up(upto - base, arena_commit_size(b));
+  if(want > b->mapped) want = b->mapped;
+  if(mprotect(b->commit, (base + want) - b->commit, PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+  b->commit = base + want;
+  return true;
+}
+
+static arena_block *arena_pool_take(void) {
+  arena_block *b = NULL;
+  pthread_mutex_lock(&arena_pool.lock);
+  if(arena_pool.free) {
+    b = arena_pool.free;
+    arena_pool.free = b->prev;
+    arena_pool.count--;
+  }
+  pthread_mutex_unlock(&arena_pool.lock);
+  if(b) b->prev = NULL;
+  return b;
+}
+
+/* Unmap block or put it in the pool, if it is default sized */
+static void arena_release_block(arena_block *b) {
+  if(b->size == ARENA_DEFAULT_SIZE - sizeof(arena_block)) {
+    // return the memory to the OS, except for a small warm start
+    uint8_t *keep = (uint8_t *) b + ARENA_POOL_KEEP;
+    if(b->commit > keep) {
+      madvise(keep, b->commit - keep, MADV_DONTNEED);
+      mprotect(keep, b->commit - keep, PROT_NONE);
+      b->commit = keep;
+    }
+    pthread_mutex_lock(&arena_pool.lock);
+    bool pooled = arena_pool.count < ARENA_POOL_MAX;
+    if(pooled) {
+      b->prev = arena_pool.free;
+      arena_pool.free = b;
+      arena_pool.count++;
+    }
+    pthread_mutex_unlock(&arena_pool.lock);
+    if(pooled) return;
+  }
+  munmap(b, b->mapped);
+}
+
+/* Reserve address space for a block of (at least) the given usable size */
+static arena_block *arena_new_block(size_t size) {
+  if(size == ARENA_DEFAULT_SIZE - sizeof(arena_block)) {
+    arena_block *b = arena_pool_take();
+    if(b) return b;
+  }
+  size_t mapped = arena_round_up(size + sizeof(arena_block), ARENA_COMMIT_SIZE);
+  size_t align = ARENA_COMMIT_SIZE;
+#ifdef ARENA_HUGE_PAGES
+  if(size >= ARENA_HUGE_PAGE_MIN) {
+    mapped = arena_round_up(mapped, ARENA_HUGE_PAGE_SIZE);
+    align = ARENA_HUGE_PAGE_SIZE;
+  }
+#endif
+  // over reserve so the block can be aligned, then trim the excess
+  size_t reserve = mapped + (align > ARENA_COMMIT_SIZE ? align : 0);
+  uint8_t *p = mmap(NULL, reserve, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(p == MAP_FAILED) return NULL;
+  uint8_t *base = (uint8_t *) arena_round_up((uintptr_t) p, align);
+  if(base > p) munmap(p, base - p);
+  if(p + reserve > base + mapped) munmap(base + mapped, (p + reserve) - (base + mapped));
+#ifdef ARENA_HUGE_PAGES
+  if(align == ARENA_HUGE_PAGE_SIZE) madvise(base, mapped, MADV_HUGEPAGE);
+#endif
+
+  // commit the first chunk for the header
+  size_t first = align > ARENA_COMMIT_SIZE ? align : ARENA_COMMIT_SIZE;
+  if(mprotect(base, first, PROT_READ | PROT_WRITE) != 0) {
+    munmap(base, mapped);
+    return NULL;
+  }
+  arena_block *b = (arena_block *) base;
+  *b = (arena_block) { .prev = NULL, .size = mapped - sizeof(arena_block),
+                       .commit = base + first, .mapped = mapped };
+  return b;
+}
+
+static void arena_use_block(arena *arena, arena_block *b) {
+  arena->block = b;
+  arena->start = (uint8_t *) (b + 1);
+  arena->cur = arena->start;
+  arena->end = arena->start + b->size;
+}
+
+/* Chain a new block that can hold at least need bytes */
+static bool arena_grow(arena *arena, size_t need) {
+  size_t size = arena->block->size + sizeof(arena_block);
+  if(size < ARENA_MAX_BLOCK_SIZE) size *= 2;
+  if(size < need + sizeof(arena_block)) size = need + sizeof(arena_block);
+  arena_block *b = arena_new_block(size - sizeof(arena_block));
+  if(!b) return false;
+  b->prev = arena->block;
+  arena_use_block(arena, b);
+  return true;
+}
+
+void *arena_alloc_uninit(arena *arena, ptrdiff_t size, ptrdiff_t align,
+                         ptrdiff_t count) {
+  if(!arena->block) {
     arena_init(arena, ARENA_DEFAULT_SIZE);
+    if(!arena->block) {
+      arena_error("Could not allocate arena memory");
+      return NULL;
+    }
+  }
+  ptrdiff_t total;
+  if(__builtin_mul_overflow(size, count, &total)) {
+    arena_error("Arena allocation size overflow: %ld * %ld", size, count);
+    return NULL;
   }
   ptrdiff_t pad = -(uintptr_t)arena->cur & (align - 1);
-  if(arena->cur + pad + (count * size) >= arena->end) {
-    error("Out of arena memory, tried to allocate %ld (pad %ld)", (count*size), pad);
+  if(total + pad > arena->end - arena->cur) {
+    // new block, fresh blocks are max aligned so no padding needed
+    if(!arena_grow(arena, total + align)) {
+      arena_error("Out of arena memory, tried to allocate %ld (pad %ld)", total, pad);
+      return NULL;
+    }
+    pad = -(uintptr_t)arena->cur & (align - 1);
+  }
+  uint8_t *p = arena->cur + pad;
+  if(p + total > arena->block->commit && !arena_commit(arena->block, p + total)) {
+    arena_error("Could not commit arena memory, tried to allocate %ld", total);
     return NULL;
-  } else {
-    void *p = arena->cur + pad;
-    //printf("allocated pointer of %llu (size: %ld, count: %ld, align: %ld, pad: %ld)\n", (uint64_t) p, size, count, align,pad);
-    memset(p, 0, count * size);
-    //printf("memset done\n");
-    arena->cur += pad + (count * size);
-    return (void *)p;
   }
+  arena->cur = p + total;
+  return p;
+}
+
+void *arena_alloc(arena *arena, ptrdiff_t size, ptrdiff_t align,
+                      ptrdiff_t count) {
+  // pooled blocks are reused without clearing, so always zero
+  void *p = arena_alloc_uninit(arena, size, align, count);
+  if(p) memset(p, 0, size * count);
+  return p;
 }
 
 /**
- * Init a new arena by allocating memory for it via malloc.
+ * Init a new arena, only reserves the memory.
  */
 void arena_init(arena *arena, size_t capacity) {
-  arena->start = (uint8_t *) malloc(capacity);
-  arena->cur = arena->start;
-  arena->end = arena->start + capacity;
+  if(capacity < ARENA_COMMIT_SIZE) capacity = ARENA_COMMIT_SIZE;
+  arena_block *b = arena_new_block(capacity - sizeof(arena_block));
+  if(!b) {
+    *arena = (struct arena) {0};
+    return;
+  }
+  arena_use_block(arena, b);
 }
 
-void arena_free(arena *arena) {
-  if(arena->start != NULL) {
-    free(arena->start);
-    arena->start = NULL;
-    arena->cur = NULL;
-    arena->end = NULL;
+/* Release blocks newer than the given one (NULL releases all) */
+static void arena_free_until(arena *arena, arena_block *keep) {
+  arena_block *b = arena->block;
+  while(b && b != keep) {
+    arena_block *prev = b->prev;
+    arena_release_block(b);
+    b = prev;
   }
+  arena->block = b;
+}
+
+void arena_free(arena *arena) {
+  arena_free_until(arena, NULL);
+  arena->start = NULL;
+  arena->cur = NULL;
+  arena->end = NULL;
 }
 
 void arena_clear(arena *arena) {
+  if(!arena->block) return;
+  // keep the newest (largest) block, release the smaller ones before it
+  arena_block *b = arena->block->prev;
+  while(b) {
+    arena_block *prev = b->prev;
+    arena_release_block(b);
+    b = prev;
+  }
+  arena->block->prev = NULL;
   arena->cur = arena->start;
 }
 
+arena_checkpoint arena_mark(arena *arena) {
+  return (arena_checkpoint) { .block = arena->block, .cur = arena->cur };
+}
+
+void arena_rewind(arena *arena, arena_checkpoint cp) {
+  if(!cp.block) {
+    // marked before anything was allocated
+    arena_clear(arena);
+    return;
+  }
+  arena_free_until(arena, cp.block);
+  arena_use_block(arena, cp.block);
+  arena->cur = cp.cur;
+}
+
 char *arena_str(arena *arena, char *str) {
   if(str == NULL) return NULL;
   size_t len = strlen(str)+1;
-  char *out = (char*) arena_alloc(arena, len, 1, 1);
+  char *out = (char*) arena_alloc_uninit(arena, len, 1, 1);
   if(!out) return NULL;
   memcpy(out, str, len);
   return out;
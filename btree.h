@@ -0,0 +1,205 @@
+#ifndef btree_h
+#define btree_h
+#include <stdbool.h>
+#include <stdint.h>
+
+/* == B+tree with subtree sums ==
+ * Ordered int32 key -> int32 value pairs (duplicate keys allowed), where
+ * inner nodes keep the count and value sum of each child. Inserting and
+ * getting the count and sum of all values in a key range are O(log n),
+ * a range query is two root to leaf walks.
+ *
+ * Nodes are slab allocated, needs SLAB_IMPLEMENTATION in the program.
+ */
+
+#define BTREE_ORDER 32 // max entries per node
+
+typedef struct btree_node {
+  uint16_t n;
+  bool leaf;
+  int32_t keys[BTREE_ORDER + 1]; // leaf: keys, inner: smallest key of each child
+} btree_node;
+
+typedef struct btree {
+  btree_node *root;
+  uint32_t count;
+} btree;
+
+void btree_insert(btree *t, int32_t key, int32_t value);
+
+/* Count and sum of values with min <= key <= max */
+void btree_range(btree *t, int32_t min, int32_t max, uint32_t *count, int64_t *sum);
+
+void btree_free(btree *t);
+#endif
+
+#ifdef BTREE_IMPLEMENTATION
+#include <string.h>
+#include "slab.h"
+
+typedef struct btree_leaf {
+  btree_node hdr;
+  int32_t values[BTREE_ORDER + 1];
+} btree_leaf;
+
+typedef struct btree_inner {
+  btree_node hdr;
+  btree_node *child[BTREE_ORDER + 1];
+  uint32_t counts[BTREE_ORDER + 1];
+  int64_t sums[BTREE_ORDER + 1];
+} btree_inner;
+
+DefineSlab(btree_leaf_slab, btree_leaf);
+DefineSlab(btree_inner_slab, btree_inner);
+
+#define btree_as_leaf(node) ((btree_leaf *) (node))
+#define btree_as_inner(node) ((btree_inner *) (node))
+
+static void btree_totals(btree_node *node, uint32_t *count, int64_t *sum) {
+  *count = 0;
+  *sum = 0;
+  for(int i = 0; i < node->n; i++) {
+    if(node->leaf) {
+      *count += 1;
+      *sum += btree_as_leaf(node)->values[i];
+    } else {
+      *count += btree_as_inner(node)->counts[i];
+      *sum += btree_as_inner(node)->sums[i];
+    }
+  }
+}
+
+/* Move upper half of a full node to a new right sibling */
+static btree_node *btree_split(btree_node *node) {
+  int half = node->n / 2, moved = node->n - half;
+  btree_node *right;
+  if(node->leaf) {
+    btree_leaf *r = slab_new(&btree_leaf_slab, btree_leaf);
+    memcpy(r->values, btree_as_leaf(node)->values + half, moved * sizeof(int32_t));
+    right = &r->hdr;
+  } else {
+    btree_inner *r = slab_new(&btree_inner_slab, btree_inner), *l = btree_as_inner(node);
+    memcpy(r->child, l->child + half, moved * sizeof(btree_node *));
+    memcpy(r->counts, l->counts + half, moved * sizeof(uint32_t));
+    memcpy(r->sums, l->sums + half, moved * sizeof(int64_t));
+    right = &r->hdr;
+  }
+  right->leaf = node->leaf;
+  right->n = moved;
+  memcpy(right->keys, node->keys + half, moved * sizeof(int32_t));
+  node->n = half;
+  return right;
+}
+
+/* Insert into subtree, returns new right sibling if node was split */
+static btree_node *btree_insert_rec(btree_node *node, int32_t key, int32_t value) {
+  // last entry with key <= new key, after equal keys
+  int i = 0;
+  while(i < node->n && node->keys[i] <= key) i++;
+  if(node->leaf) {
+    btree_leaf *leaf = btree_as_leaf(node);
+    memmove(&node->keys[i + 1], &node->keys[i], (node->n - i) * sizeof(int32_t));
+    memmove(&leaf->values[i + 1], &leaf->values[i], (node->n - i) * sizeof(int32_t));
+    node->keys[i] = key;
+    leaf->values[i] = value;
+    node->n++;
+  } else {
+    btree_inner *inner = btree_as_inner(node);
+    if(i > 0) i--;
+    if(key < node->keys[i]) node->keys[i] = key;
+    inner->counts[i]++;
+    inner->sums[i] += value;
+    btree_node *right = btree_insert_rec(inner->child[i], key, value);
+    if(right) {
+      uint32_t count;
+      int64_t sum;
+      btree_totals(right, &count, &sum);
+      inner->counts[i] -= count;
+      inner->sums[i] -= sum;
+      int at = i + 1, tail = node->n - at;
+      memmove(&node->keys[at + 1], &node->keys[at], tail * sizeof(int32_t));
+      memmove(&inner->child[at + 1], &inner->child[at], tail * sizeof(btree_node *));
+      memmove(&inner->counts[at + 1], &inner->counts[at], tail * sizeof(uint32_t));
+      memmove(&inner->sums[at + 1], &inner->sums[at], tail * sizeof(int64_t));
+      node->keys[at] = right->keys[0];
+      inner->child[at] = right;
+      inner->counts[at] = count;
+      inner->sums[at] = sum;
+      node->n++;
+    }
+  }
+  return node->n > BTREE_ORDER ? btree_split(node) : NULL;
+}
+
+void btree_insert(btree *t, int32_t key, int32_t value) {
+  if(!t->root) {
+    t->root = (btree_node *) slab_new(&btree_leaf_slab, btree_leaf);
+    t->root->leaf = true;
+  }
+  btree_node *right = btree_insert_rec(t->root, key, value);
+  if(right) {
+    btree_inner *root = slab_new(&btree_inner_slab, btree_inner);
+    root->hdr.n = 2;
+    root->hdr.keys[0] = t->root->keys[0];
+    root->hdr.keys[1] = right->keys[0];
+    root->child[0] = t->root;
+    root->child[1] = right;
+    btree_totals(t->root, &root->counts[0], &root->sums[0]);
+    btree_totals(right, &root->counts[1], &root->sums[1]);
+    t->root = &root->hdr;
+  }
+  t->count++;
+}
+
+/* Count and sum of values with key < x */
+static void btree_prefix(btree_node *node, int64_t x, uint32_t *count, int64_t *sum) {
+  *count = 0;
+  *sum = 0;
+  while(node) {
+    if(node->leaf) {
+      btree_leaf *leaf = btree_as_leaf(node);
+      for(int i = 0; i < node->n && node->keys[i] < x; i++) {
+        *count += 1;
+        *sum += leaf->values[i];
+      }
+      return;
+    }
+    // children before the last one starting below x only have keys < x
+    btree_inner *inner = btree_as_inner(node);
+    int i = 0;
+    while(i + 1 < node->n && node->keys[i + 1] < x) {
+      *count += inner->counts[i];
+      *sum += inner->sums[i];
+      i++;
+    }
+    node = inner->child[i];
+  }
+}
+
+void btree_range(btree *t, int32_t min, int32_t max, uint32_t *count, int64_t *sum) {
+  *count = 0;
+  *sum = 0;
+  if(min > max) return;
+  uint32_t below_count, upto_count;
+  int64_t below_sum, upto_sum;
+  btree_prefix(t->root, min, &below_count, &below_sum);
+  btree_prefix(t->root, (int64_t) max + 1, &upto_count, &upto_sum);
+  *count = upto_count - below_count;
+  *sum = upto_sum - below_sum;
+}
+
+static void btree_free_rec(btree_node *node) {
+  if(node->leaf) {
+    slab_free(&btree_leaf_slab, node);
+  } else {
+    for(int i = 0; i < node->n; i++) btree_free_rec(btree_as_inner(node)->child[i]);
+    slab_free(&btree_inner_slab, node);
+  }
+}
+
+void btree_free(btree *t) {
+  if(t->root) btree_free_rec(t->root);
+  t->root = NULL;
+  t->count = 0;
+}
+#endif
@@ -0,0 +1,201 @@
+#ifndef colstore_h
+#define colstore_h
+#include <stdbool.h>
+#include <stdint.h>
+#include "dynarr.h"
+
+/* == Compressed column store ==
+ * Same job as btree.h (int32 key -> int32 value, count and sum of a key
+ * range) but for less memory. Inserts collect in a small buffer, full
+ * buffers are sorted by key and sealed into a block: keys as bit packed
+ * deltas from the previous key, values bit packed relative to the block
+ * minimum, with just enough bits for the largest one.
+ *
+ * Each block keeps min and max key, count and sum, so a range query only
+ * looks at the summary of blocks entirely inside or outside the range
+ * and decodes the blocks on its boundaries.
+ *
+ * Block data is packed back to back in an arena owned by the store.
+ *
+ * Needs DYNARR_IMPLEMENTATION and ARENA_IMPLEMENTATION in the program.
+ */
+
+#define COLSTORE_BLOCK 128 // entries per block
+
+typedef struct colstore_block {
+  int32_t min_key, max_key;
+  int32_t min_value;
+  uint16_t count;
+  uint8_t key_bits, value_bits; // bits per packed key delta and value
+  int64_t sum;
+  uint8_t *data; // packed key deltas, then packed values
+  uint32_t data_len;
+} colstore_block;
+
+DefineArray(colstore_blocks, colstore_block);
+
+typedef struct colstore {
+  colstore_blocks blocks;
+  arena data; // packed data of all blocks
+  uint32_t count;
+  uint32_t pending; // entries not yet sealed into a block
+  int32_t pending_keys[COLSTORE_BLOCK];
+  int32_t pending_values[COLSTORE_BLOCK];
+} colstore;
+
+/* Returns false if out of memory, the entry is then not stored */
+bool colstore_insert(colstore *cs, int32_t key, int32_t value);
+
+/* Count and sum of values with min <= key <= max */
+void colstore_range(colstore *cs, int32_t min, int32_t max, uint32_t *count, int64_t *sum);
+
+void colstore_free(colstore *cs);
+#endif
+
+#ifdef COLSTORE_IMPLEMENTATION
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct colstore_pair {
+  int32_t key, value;
+} colstore_pair;
+
+static int colstore_pair_cmp(const void *a, const void *b) {
+  int32_t ka = ((colstore_pair *) a)->key, kb = ((colstore_pair *) b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+static int colstore_bits(uint32_t max) { return max ? 32 - __builtin_clz(max) : 0; }
+
+/* Packed areas are followed by 8 bytes of padding, so every field can be
+ * read and written with one unaligned 64 bit access */
+static void colstore_pack(uint8_t *to, int bits, uint32_t i, uint32_t x) {
+  uint64_t at = (uint64_t) i * bits, w;
+  memcpy(&w, to + at / 8, 8);
+  w |= (uint64_t) x << (at % 8);
+  memcpy(to + at / 8, &w, 8);
+}
+
+static inline uint32_t colstore_unpack(const uint8_t *from, int bits, uint32_t i) {
+  uint64_t at = (uint64_t) i * bits, w;
+  memcpy(&w, from + at / 8, 8);
+  return (w >> (at % 8)) & (uint32_t) ((1ull << bits) - 1);
+}
+
+static bool colstore_seal(colstore *cs) {
+  uint32_t n = cs->pending;
+  colstore_pair pairs[COLSTORE_BLOCK];
+  for(uint32_t i = 0; i < n; i++) {
+    pairs[i] = (colstore_pair) { cs->pending_keys[i], cs->pending_values[i] };
+  }
+  qsort(pairs, n, sizeof(colstore_pair), colstore_pair_cmp);
+
+  colstore_block b = { .min_key = pairs[0].key, .max_key = pairs[n - 1].key,
+                       .min_value = pairs[0].value, .count = n };
+  // deltas and values relative to the minimum can need all 32 bits
+#define colstore_delta(i) ((uint32_t) pairs[i].key - (uint32_t) pairs[(i) - 1].key)
+  uint32_t max_delta = 0, max_value = 0;
+  for(uint32_t i = 0; i < n; i++) {
+    if(pairs[i].value < b.min_value) b.min_value = pairs[i].value;
+    if(i > 0 && colstore_delta(i) > max_delta) max_delta = colstore_delta(i);
+    b.sum += pairs[i].value;
+  }
+  for(uint32_t i = 0; i < n; i++) {
+    uint32_t v = (uint32_t) pairs[i].value - (uint32_t) b.min_value;
+    if(v > max_value) max_value = v;
+  }
+  b.key_bits = colstore_bits(max_delta);
+  b.value_bits = colstore_bits(max_value);
+
+  uint32_t key_bytes = (n * b.key_bits + 7) / 8;
+  b.data_len = key_bytes + (n * b.value_bits + 7) / 8 + 8;
+  b.data = new(&cs->data, uint8_t, b.data_len);
+  if(!b.data) return false;
+  for(uint32_t i = 0; i < n; i++) {
+    if(i > 0) colstore_pack(b.data, b.key_bits, i, colstore_delta(i));
+    colstore_pack(b.data + key_bytes, b.value_bits, i,
+                  (uint32_t) pairs[i].value - (uint32_t) b.min_value);
+  }
+#undef colstore_delta
+  da_append(&cs->blocks, b);
+  cs->pending = 0;
+  return true;
+}
+
+bool colstore_insert(colstore *cs, int32_t key, int32_t value) {
+  // full buffer is sealed on the next insert
+  if(cs->pending == COLSTORE_BLOCK && !colstore_seal(cs)) return false;
+  cs->pending_keys[cs->pending] = key;
+  cs->pending_values[cs->pending] = value;
+  cs->pending++;
+  cs->count++;
+  return true;
+}
+
+/* Number of sorted keys < x */
+static uint32_t colstore_count_below(const int32_t *keys, uint32_t n, int64_t x) {
+  if(x > INT32_MAX) return n;
+  if(x <= INT32_MIN) return 0;
+  uint32_t i = 0, count = 0;
+#ifdef __SSE2__
+  __m128i xs = _mm_set1_epi32((int32_t) x);
+  for(; i + 4 <= n; i += 4) {
+    __m128i lt = _mm_cmplt_epi32(_mm_loadu_si128((const __m128i *) (keys + i)), xs);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(lt));
+    count += __builtin_popcount(mask);
+    if(mask != 0xF) return count; // sorted, rest are >= x
+  }
+#endif
+  for(; i < n && keys[i] < x; i++) count++;
+  return count;
+}
+
+/* Add count and sum of entries of a partially covered block */
+static void colstore_block_range(colstore_block *b, int32_t min, int32_t max,
+                                 uint32_t *count, int64_t *sum) {
+  int32_t keys[COLSTORE_BLOCK];
+  uint32_t key = b->min_key;
+  for(uint32_t i = 0; i < b->count; i++) {
+    if(i > 0) key += colstore_unpack(b->data, b->key_bits, i);
+    keys[i] = (int32_t) key;
+  }
+  uint32_t from = colstore_count_below(keys, b->count, min);
+  uint32_t to = colstore_count_below(keys, b->count, (int64_t) max + 1);
+  const uint8_t *values = b->data + (b->count * b->key_bits + 7) / 8;
+  uint64_t packed = 0;
+  for(uint32_t i = from; i < to; i++) packed += colstore_unpack(values, b->value_bits, i);
+  *count += to - from;
+  *sum += (int64_t) packed + (int64_t) b->min_value * (to - from);
+}
+
+void colstore_range(colstore *cs, int32_t min, int32_t max, uint32_t *count, int64_t *sum) {
+  *count = 0;
+  *sum = 0;
+  if(min > max) return;
+  for(uint32_t i = 0; i < cs->blocks.size; i++) {
+    colstore_block *b = &cs->blocks.items[i];
+    if(b->max_key < min || b->min_key > max) continue;
+    if(b->min_key >= min && b->max_key <= max) {
+      *count += b->count;
+      *sum += b->sum;
+    } else {
+      colstore_block_range(b, min, max, count, sum);
+    }
+  }
+  for(uint32_t i = 0; i < cs->pending; i++) {
+    if(cs->pending_keys[i] >= min && cs->pending_keys[i] <= max) {
+      *count += 1;
+      *sum += cs->pending_values[i];
+    }
+  }
+}
+
+void colstore_free(colstore *cs) {
+  da_free(&cs->blocks);
+  arena_free(&cs->data);
+  cs->count = cs->pending = 0;
+}
+#endif
@@ -1,27 +1,100 @@
 #ifndef dynarr_h
 #define dynarr_h
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
 typedef struct {
   char *items;
   uint32_t size, capacity;
 } _Arr;
 
+/* Flags in capacity for arrays whose items are not owned by the heap */
+#define DA_EXTERNAL 0x80000000u // inline storage or arena, don't realloc/free
+#define DA_ARENA    0x40000000u // grows in the arena after the header
+#define DA_CAPACITY(arr) ((arr)->capacity & ~(DA_EXTERNAL | DA_ARENA))
+
+typedef struct {
+  char *items;
+  uint32_t size, capacity;
+  arena *arena;
+} _ArenaArr;
+
 #define DefineArray(type, item_type)                                    \
   typedef struct {                                                      \
     item_type *items;                                                   \
     uint32_t size, capacity;                                            \
   } type;
 
+/* Array with N items of inline storage, spills to the heap when full.
+ * Initialize with da_small_init. The items pointer points inside the
+ * struct, so it must not be moved or copied by value after init. */
+#define DefineSmallArray(type, item_type, N)                                   \
+  typedef struct {                                                             \
+    item_type *items;                                                          \
+    uint32_t size, capacity;                                                   \
+    item_type inline_items[N];                                                 \
+  } type;
+
+#define da_small_init(arr)                                                     \
+  do {                                                                         \
+    (arr)->items = (arr)->inline_items;                                        \
+    (arr)->size = 0;                                                           \
+    (arr)->capacity = (sizeof((arr)->inline_items) /                           \
+                       sizeof((arr)->inline_items[0])) | DA_EXTERNAL;          \
+  } while (0)
+
+/* Array that grows inside an arena, released with the arena.
+ * Initialize with da_arena_init. */
+#define DefineArenaArray(type, item_type)                                      \
+  typedef struct {                                                             \
+    item_type *items;                                                          \
+    uint32_t size, capacity;                                                   \
+    arena *arena;                                                              \
+  } type;
+
+#define da_arena_init(arr, a)                                                  \
+  do {                                                                         \
+    (arr)->items = NULL;                                                       \
+    (arr)->size = 0;                                                           \
+    (arr)->capacity = DA_EXTERNAL | DA_ARENA;                                  \
+    (arr)->arena = (a);                                                        \
+  } while (0)
+
 void _da_ensure(_Arr *a, uint32_t data_size);
+void _da_reserve(_Arr *a, uint32_t capacity, uint32_t data_size);
 
 #define DA_INITIAL_CAPACITY 8
 #define DA_GROWTH_FACTOR 1.618 // golden ratio
 
-#define da_init(arr) { (arr)->items = NULL; (arr)->capacity = 0; (arr)->size = 0; }
+#define da_init(arr)                                                           \
+  do {                                                                         \
+    (arr)->items = NULL;                                                       \
+    (arr)->capacity = 0;                                                       \
+    (arr)->size = 0;                                                           \
+  } while (0)
+
+#define da_append(arr, item)                                                   \
+  do {                                                                         \
+    _da_ensure((_Arr *)(arr), sizeof(*((arr)->items)));                        \
+    (arr)->items[(arr)->size++] = (item);                                      \
+  } while (0)
+
+/* Make room for at least n items in total */
+#define da_reserve(arr, n)                                                     \
+  _da_reserve((_Arr *)(arr), (n), sizeof(*((arr)->items)))
 
-#define da_append(arr, item)                                           \
-  _da_ensure((_Arr*)(arr), sizeof(*((arr)->items)));                  \
-  (arr)->items[(arr)->size++] = (item);
+/* Append n items copied from src */
+#define da_append_n(arr, src, n)                                               \
+  do {                                                                         \
+    uint32_t _da_n = (n);                                                      \
+    da_reserve(arr, (arr)->size + _da_n);                                      \
+    memcpy(&(arr)->items[(arr)->size], (src),                                  \
+           _da_n * sizeof(*((arr)->items)));                                   \
+    (arr)->size += _da_n;                                                      \
+  } while (0)
 
 #define da_lastptr(type, arr) (type*)&(arr)->items[arr->size - 1]
 
@@ -47,13 +120,141 @@ void _da_ensure(_Arr *a, uint32_t data_size);
     }                                                                          \
   }
 
-#define da_free(arr) { if((arr)->items) free((arr)->items); (arr)->items = NULL; (arr)->capacity = 0; (arr)->size = 0; }
+#define da_free(arr) { if((arr)->items && !((arr)->capacity & DA_EXTERNAL)) free((arr)->items); (arr)->items = NULL; (arr)->capacity = 0; (arr)->size = 0; }
 
 
 void _da_front(_Arr *arr, uint32_t i, uint32_t data_size);
+
+/* == Sorted arrays ==
+ * The less argument is a function or macro less(a, b) that returns true
+ * if item a orders before item b. The key is an item (only the fields
+ * used by less need to be set).
+ *
+ * Searches are branchless: the loop does a fixed number of iterations
+ * for a given size and the compiler turns the select into a cmov.
+ */
+
+/* Index of first item that is not less than key (size if none) */
+#define da_lower_bound(arr, key, less)                                         \
+  ({                                                                           \
+    __typeof__((arr)->items[0]) _da_key = (key);                               \
+    __typeof__((arr)->items) _da_base = (arr)->items;                          \
+    uint32_t _da_len = (arr)->size;                                            \
+    while (_da_len > 1) {                                                      \
+      uint32_t _da_half = _da_len / 2;                                         \
+      _da_base = less(_da_base[_da_half - 1], _da_key) ? _da_base + _da_half   \
+                                                       : _da_base;             \
+      _da_len -= _da_half;                                                     \
+    }                                                                          \
+    (uint32_t)(_da_base - (arr)->items) +                                      \
+        (uint32_t)(_da_len == 1 && less(_da_base[0], _da_key));                \
+  })
+
+/* Index of first item that key is less than (size if none) */
+#define da_upper_bound(arr, key, less)                                         \
+  ({                                                                           \
+    __typeof__((arr)->items[0]) _da_key = (key);                               \
+    __typeof__((arr)->items) _da_base = (arr)->items;                          \
+    uint32_t _da_len = (arr)->size;                                            \
+    while (_da_len > 1) {                                                      \
+      uint32_t _da_half = _da_len / 2;                                         \
+      _da_base = !less(_da_key, _da_base[_da_half - 1]) ? _da_base + _da_half  \
+                                                        : _da_base;            \
+      _da_len -= _da_half;                                                     \
+    }                                                                          \
+    (uint32_t)(_da_base - (arr)->items) +                                      \
+        (uint32_t)(_da_len == 1 && !less(_da_key, _da_base[0]));               \
+  })
+
+/* Insert item keeping array sorted (after any equal items), returns index */
+#define da_insert_sorted(arr, item, less)                                      \
+  ({                                                                           \
+    __typeof__((arr)->items[0]) _da_item = (item);                             \
+    uint32_t _da_at = da_upper_bound(arr, _da_item, less);                     \
+    _da_ensure((_Arr *)(arr), sizeof(*((arr)->items)));                        \
+    memmove(&(arr)->items[_da_at + 1], &(arr)->items[_da_at],                  \
+            ((arr)->size - _da_at) * sizeof(*((arr)->items)));                 \
+    (arr)->items[_da_at] = _da_item;                                           \
+    (arr)->size++;                                                             \
+    _da_at;                                                                    \
+  })
+
+/* == Binary heap ==
+ * Max heap ordered by less, the greatest item is at index 0.
+ */
+#define da_heap_top(arr) ((arr)->items[0])
+
+#define _da_sift_up(arr, start, less)                                          \
+  do {                                                                         \
+    uint32_t _da_i = (start);                                                  \
+    __typeof__((arr)->items[0]) _da_tmp = (arr)->items[_da_i];                 \
+    while (_da_i > 0) {                                                        \
+      uint32_t _da_p = (_da_i - 1) / 2;                                        \
+      if (!less((arr)->items[_da_p], _da_tmp)) break;                          \
+      (arr)->items[_da_i] = (arr)->items[_da_p];                               \
+      _da_i = _da_p;                                                           \
+    }                                                                          \
+    (arr)->items[_da_i] = _da_tmp;                                             \
+  } while (0)
+
+#define _da_sift_down(arr, start, less)                                        \
+  do {                                                                         \
+    uint32_t _da_i = (start), _da_n = (arr)->size;                             \
+    __typeof__((arr)->items[0]) _da_tmp = (arr)->items[_da_i];                 \
+    while (1) {                                                                \
+      uint32_t _da_c = 2 * _da_i + 1;                                          \
+      if (_da_c >= _da_n) break;                                               \
+      if (_da_c + 1 < _da_n && less((arr)->items[_da_c], (arr)->items[_da_c + 1])) \
+        _da_c++;                                                               \
+      if (!less(_da_tmp, (arr)->items[_da_c])) break;                          \
+      (arr)->items[_da_i] = (arr)->items[_da_c];                               \
+      _da_i = _da_c;                                                           \
+    }                                                                          \
+    (arr)->items[_da_i] = _da_tmp;                                             \
+  } while (0)
+
+#define da_heap_push(arr, item, less)                                          \
+  do {                                                                         \
+    da_append(arr, item);                                                      \
+    _da_sift_up(arr, (arr)->size - 1, less);                                   \
+  } while (0)
+
+/* Remove and return the greatest item, heap must not be empty */
+#define da_heap_pop(arr, less)                                                 \
+  ({                                                                           \
+    __typeof__((arr)->items[0]) _da_top = (arr)->items[0];                     \
+    (arr)->items[0] = (arr)->items[--(arr)->size];                             \
+    if ((arr)->size > 0) _da_sift_down(arr, 0, less);                          \
+    _da_top;                                                                   \
+  })
+
+/* Restore heap order after the item at index i was changed */
+#define da_heap_fix(arr, i, less)                                              \
+  do {                                                                         \
+    uint32_t _da_fix = (i);                                                    \
+    if (_da_fix > 0 && less((arr)->items[(_da_fix - 1) / 2], (arr)->items[_da_fix])) \
+      _da_sift_up(arr, _da_fix, less);                                         \
+    else                                                                       \
+      _da_sift_down(arr, _da_fix, less);                                       \
+  } while (0)
+
+/* Remove item at index i */
+#define da_heap_del(arr, i, less)                                              \
+  do {                                                                         \
+    uint32_t _da_del = (i);                                                    \
+    (arr)->items[_da_del] = (arr)->items[--(arr)->size];                       \
+    if (_da_del < (arr)->size) da_heap_fix(arr, _da_del, less);                \
+  } while (0)
 #endif
 
-#ifdef DYNARR_IMPLEMENTATION
+#if defined(DYNARR_IMPLEMENTATION) && !defined(dynarr_implemented)
+#define dynarr_implemented
+
+#define da_panic(fmt, ...)                                                     \
+  do {                                                                         \
+    fprintf(stderr, "[ERROR] " fmt "\n", ##__VA_ARGS__);                       \
+    exit(1);                                                                   \
+  } while (0)
 
 void _da_front(_Arr *arr, uint32_t i, uint32_t data_size) {
   uint8_t buf[128];
@@ -65,12 +266,64 @@ void _da_front(_Arr *arr, uint32_t i, uint32_t data_size) {
   }
 }
 
+/* Move items of an inline or arena array to new storage of given capacity */
+static void _da_grow_external(_Arr *a, uint32_t capacity, uint32_t data_size) {
+  uint32_t old_capacity = DA_CAPACITY(a);
+  if(a->capacity & DA_ARENA) {
+    arena *ar = ((_ArenaArr *) a)->arena;
+    size_t old_end = (size_t) old_capacity * data_size;
+    size_t extra = (size_t) (capacity - old_capacity) * data_size;
+    if(a->items && (uint8_t *) a->items + old_end == ar->cur &&
+       extra <= (size_t) (ar->end - ar->cur) &&
+       arena_alloc_uninit(ar, extra, 1, 1)) {
+      // last allocation in the arena, extend it in place
+    } else {
+      char *items = arena_alloc_uninit(ar, (size_t) capacity * data_size,
+                                       alignof(max_align_t), 1);
+      if(!items) {
+        da_panic("Could not grow arena array, from %u to %u", a->size, capacity);
+      }
+      if(a->size) memcpy(items, a->items, (size_t) a->size * data_size);
+      a->items = items;
+    }
+    a->capacity = capacity | DA_EXTERNAL | DA_ARENA;
+  } else {
+    // spill inline items to the heap, the array owns its items after this
+    char *items = malloc((size_t) capacity * data_size);
+    if(!items) {
+      da_panic("Could not grow small array, from %u to %u", a->size, capacity);
+    }
+    memcpy(items, a->items, (size_t) a->size * data_size);
+    a->items = items;
+    a->capacity = capacity;
+  }
+}
+
+void _da_reserve(_Arr *a, uint32_t capacity, uint32_t data_size) {
+  if(capacity <= DA_CAPACITY(a)) return;
+  if(a->capacity & DA_EXTERNAL) {
+    _da_grow_external(a, capacity, data_size);
+    return;
+  }
+  a->items = realloc(a->items, (size_t) capacity * data_size);
+  if(!a->items) {
+    da_panic("Could not reserve dynamic array capacity %u", capacity);
+  }
+  a->capacity = capacity;
+}
+
 void _da_ensure(_Arr *a, uint32_t data_size) {
-  if(a->size < a->capacity) return;
-  uint32_t new_capacity = a->capacity == 0 ? DA_INITIAL_CAPACITY : (a->capacity * DA_GROWTH_FACTOR);
-  a->items = realloc(a->items, new_capacity * data_size);
+  uint32_t capacity = DA_CAPACITY(a);
+  if(a->size < capacity) return;
+  uint32_t new_capacity = capacity == 0 ? DA_INITIAL_CAPACITY : (capacity * DA_GROWTH_FACTOR);
+  if(new_capacity <= capacity) new_capacity = capacity + 1;
+  if(a->capacity & DA_EXTERNAL) {
+    _da_grow_external(a, new_capacity, data_size);
+    return;
+  }
+  a->items = realloc(a->items, (size_t) new_capacity * data_size);
   if(!a->items) {
-    panic("Could not grow dynamic array, from %u to %u", a->size, new_capacity);
+    da_panic("Could not grow dynamic array, from %u to %u", a->size, new_capacity);
   }
 //dbg("dyn array new capacity: %u (%u bytes)", new_capacity, new_capacity*data_size);
   a->capacity = new_capacity;
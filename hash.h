@@ -1,11 +1,130 @@
 #ifndef hash_h
 #define hash_h
 #include <stdint.h>
-unsigned long hash(uint8_t *data, size_t len);
+#include <stddef.h>
+#include <string.h>
+
+/* == Hashing ==
+ * hash is wyhash (final version 4): reads 8 bytes at a time, keys up to
+ * 16 bytes take a couple of loads and a single multiply.
+ *
+ * The seed is random per process (set before main), so bucket indexes
+ * can't be predicted by clients sending keys to collide.
+ */
+
+/* Per process random seed used by hash */
+extern uint64_t hash_seed;
+
+/* Hash bytes with the process seed */
+uint64_t hash(const void *data, size_t len);
+
+/* Hash bytes with given seed */
+uint64_t hash_seeded(const void *data, size_t len, uint64_t seed);
+
+/* Old byte at a time djb2, not seeded */
+unsigned long hash_djb2(uint8_t *data, size_t len);
+
+static const uint64_t _wyp[4] = {
+  0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+  0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+/* 64x64 -> 128 bit multiply, low half to A and high half to B */
+static inline void _wymum(uint64_t *A, uint64_t *B) {
+  __uint128_t r = *A;
+  r *= *B;
+  *A = (uint64_t) r;
+  *B = (uint64_t) (r >> 64);
+}
+
+static inline uint64_t _wymix(uint64_t A, uint64_t B) {
+  _wymum(&A, &B);
+  return A ^ B;
+}
+
+/* Hash a single integer (pointers, ids), seeded */
+static inline uint64_t hash_u64(uint64_t x) {
+  uint64_t A = x ^ _wyp[0], B = hash_seed ^ _wyp[1];
+  _wymum(&A, &B);
+  return _wymix(A ^ _wyp[0], B ^ _wyp[1]);
+}
 #endif
-#ifdef HASH_IMPLEMENTATION
+
+#if defined(HASH_IMPLEMENTATION) && !defined(hash_implemented)
+#define hash_implemented
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t hash_seed;
+
+__attribute__((constructor)) static void hash_seed_init(void) {
+  uint64_t seed;
+  if(getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed = ((uint64_t) ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t) getpid() << 16);
+  }
+  hash_seed = seed;
+}
+
+static inline uint64_t _wyr8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t _wyr4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+// 1 to 3 bytes
+static inline uint64_t _wyr3(const uint8_t *p, size_t k) {
+  return (((uint64_t) p[0]) << 16) | (((uint64_t) p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint64_t hash_seeded(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  const uint64_t *secret = _wyp;
+  uint64_t a, b;
+  seed ^= _wymix(seed ^ secret[0], secret[1]);
+  if(__builtin_expect(len <= 16, 1)) {
+    if(__builtin_expect(len >= 4, 1)) {
+      // two overlapping 4 byte reads from both ends cover 4..16 bytes
+      size_t off = (len >> 3) << 2;
+      a = (_wyr4(p) << 32) | _wyr4(p + off);
+      b = (_wyr4(p + len - 4) << 32) | _wyr4(p + len - 4 - off);
+    } else if(len > 0) {
+      a = _wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if(__builtin_expect(i >= 48, 0)) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = _wymix(_wyr8(p) ^ secret[1], _wyr8(p + 8) ^ seed);
+        see1 = _wymix(_wyr8(p + 16) ^ secret[2], _wyr8(p + 24) ^ see1);
+        see2 = _wymix(_wyr8(p + 32) ^ secret[3], _wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while(i >= 48);
+      seed ^= see1 ^ see2;
+    }
+    while(i > 16) {
+      seed = _wymix(_wyr8(p) ^ secret[1], _wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = _wyr8(p + i - 16);
+    b = _wyr8(p + i - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  _wymum(&a, &b);
+  return _wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+uint64_t hash(const void *data, size_t len) {
+  return hash_seeded(data, len, hash_seed);
+}
+
 // modified djb2 hash: http://www.cse.yorku.ca/~oz/hash.html
-unsigned long hash(uint8_t *data, size_t len) {
+unsigned long hash_djb2(uint8_t *data, size_t len) {
   unsigned long hash = 5381;
   int c;
 
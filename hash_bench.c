@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#define HASH_IMPLEMENTATION
+#include "hash.h"
+
+/* Compare wyhash (hash) with the old djb2 on keys like the servers see.
+ * usage: hash_bench [rounds]
+ * build optimized, build.sh makes a debug build:
+ *   cc -O2 -std=gnu11 hash_bench.c -o hash_bench
+ *
+ * For each key set prints ns per key and the fullest of 4096 buckets
+ * (the unusual database table size) with each hash. */
+
+#define NKEYS 4096
+#define BUCKETS 4096
+
+typedef struct keyset {
+  const char *name;
+  uint8_t *keys[NKEYS];
+  size_t lens[NKEYS];
+} keyset;
+
+static void random_key(uint8_t *to, size_t len, const char *alphabet) {
+  size_t n = strlen(alphabet);
+  for(size_t i = 0; i < len; i++) to[i] = alphabet[rand() % n];
+}
+
+/* lengths between min and max, characters from alphabet */
+static void make_random(keyset *ks, size_t min, size_t max, const char *alphabet) {
+  for(int i = 0; i < NKEYS; i++) {
+    ks->lens[i] = min + rand() % (max - min + 1);
+    ks->keys[i] = malloc(ks->lens[i]);
+    random_key(ks->keys[i], ks->lens[i], alphabet);
+  }
+}
+
+/* "Aa" and "B@" have the same djb2 state change, so all 4096 keys made of
+ * 12 such pairs hash to the same djb2 value */
+static void make_djb2_collisions(keyset *ks) {
+  for(int i = 0; i < NKEYS; i++) {
+    ks->lens[i] = 24;
+    ks->keys[i] = malloc(24);
+    for(int j = 0; j < 12; j++) memcpy(ks->keys[i] + 2 * j, (i >> j) & 1 ? "B@" : "Aa", 2);
+  }
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t run_djb2(keyset *ks, int i) { return hash_djb2(ks->keys[i], ks->lens[i]); }
+static uint64_t run_wyhash(keyset *ks, int i) { return hash(ks->keys[i], ks->lens[i]); }
+
+static volatile uint64_t sink; // keeps the hashing from being optimized out
+
+static void bench(keyset *ks, const char *hash_name, uint64_t (*fn)(keyset *, int), int rounds) {
+  uint64_t sum = 0;
+  double start = now_ns();
+  for(int r = 0; r < rounds; r++) {
+    for(int i = 0; i < NKEYS; i++) sum += fn(ks, i);
+  }
+  sink = sum;
+  double ns = (now_ns() - start) / ((double) rounds * NKEYS);
+
+  static uint32_t load[BUCKETS];
+  memset(load, 0, sizeof(load));
+  uint32_t max = 0;
+  for(int i = 0; i < NKEYS; i++) {
+    uint32_t l = ++load[fn(ks, i) & (BUCKETS - 1)];
+    if(l > max) max = l;
+  }
+  printf("%-12s %-7s %7.2f ns/key  fullest bucket %4u\n", ks->name, hash_name, ns, max);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+  srand(42);
+  static keyset sets[4] = {
+    { .name = "plates" },   // speed daemon plates, 4-7 chars
+    { .name = "db-keys" },  // unusual database keys, mostly short
+    { .name = "db-long" },  // unusual database keys up to a full packet
+    { .name = "djb2-flood" }
+  };
+  make_random(&sets[0], 4, 7, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
+  make_random(&sets[1], 1, 32, "abcdefghijklmnopqrstuvwxyz0123456789_");
+  make_random(&sets[2], 100, 999, "abcdefghijklmnopqrstuvwxyz ");
+  make_djb2_collisions(&sets[3]);
+
+  for(int s = 0; s < 4; s++) {
+    int r = s == 2 ? rounds / 20 + 1 : rounds; // long keys take a while
+    bench(&sets[s], "djb2", run_djb2, r);
+    bench(&sets[s], "wyhash", run_wyhash, r);
+  }
+  return 0;
+}
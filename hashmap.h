@@ -0,0 +1,239 @@
+#ifndef hashmap_h
+#define hashmap_h
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hash.h"
+
+/* == Open addressing hash map ==
+ * Swiss table layout: one control byte per slot holds 7 bits of the hash
+ * (or EMPTY/DELETED), a lookup compares a whole group of 16 control bytes
+ * at once (SSE2) and only checks keys whose hash bits match.
+ *
+ * Slots hold indexes to a dense entries array, so iteration is over
+ * m.entries[0 .. m.len-1] in insertion order. Delete moves the last entry
+ * in place of the deleted one (like da_del), so when deleting while
+ * iterating, don't advance the index.
+ *
+ * Define a map type with:
+ *   DefineHashMap(type, key_type, value_type, hash_fn, eq_fn)
+ * which defines type##_entry {key, value} and the functions
+ *   type##_getp(m, key)        pointer to entry or NULL
+ *   type##_get(m, key, dflt)   value or dflt
+ *   type##_put(m, key, value)  insert or update, returns entry
+ *   type##_del(m, key)         returns true if key was present
+ *   type##_reserve(m, n)       make room for n entries
+ *   type##_free(m)
+ * A zeroed map is empty. The map doesn't copy keys, string keys
+ * must stay valid while they are in the map.
+ */
+
+#define HM_GROUP 16
+#define HM_EMPTY 0x80
+#define HM_DELETED 0xFE
+#define HM_MIN_CAPACITY 16
+
+#define HM_H1(h) ((h) >> 7)
+#define HM_H2(h) ((uint8_t)((h) & 0x7F))
+
+/* max entries for a capacity, 7/8 load */
+#define HM_MAX_LEN(capacity) ((capacity) - (capacity) / 8)
+
+/* Hash and equality for common key types */
+#define hm_hash_int(k) hash_u64((uint64_t)(k))
+#define hm_int_eq(a, b) ((a) == (b))
+#define hm_hash_str(k) hash((k), strlen(k))
+#define hm_str_eq(a, b) (strcmp((a), (b)) == 0)
+
+/* Bitmask of bytes in group equal to b */
+static inline uint32_t hm_match(const uint8_t *g, uint8_t b) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *) g);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(b)));
+#else
+  uint32_t bits = 0;
+  for(int i = 0; i < HM_GROUP; i++) bits |= (uint32_t)(g[i] == b) << i;
+  return bits;
+#endif
+}
+
+/* Bitmask of free (EMPTY or DELETED) slots, those have the high bit set */
+static inline uint32_t hm_match_free(const uint8_t *g) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) g));
+#else
+  uint32_t bits = 0;
+  for(int i = 0; i < HM_GROUP; i++) bits |= (uint32_t)(g[i] >> 7) << i;
+  return bits;
+#endif
+}
+
+/* Set control byte, the first group is mirrored after the last slot
+ * so groups can be loaded from any position without wrapping. */
+static inline void hm_set_ctrl(uint8_t *ctrl, uint32_t capacity, uint32_t i,
+                               uint8_t v) {
+  ctrl[i] = v;
+  ctrl[((i - HM_GROUP) & (capacity - 1)) + HM_GROUP] = v;
+}
+
+/* Triangular probing over groups, visits every group once */
+typedef struct hm_probe {
+  uint32_t pos, stride, mask;
+} hm_probe;
+
+static inline hm_probe hm_probe_start(uint64_t h, uint32_t capacity) {
+  return (hm_probe){ .pos = HM_H1(h) & (capacity - 1), .stride = 0,
+                     .mask = capacity - 1 };
+}
+
+static inline void hm_probe_next(hm_probe *p) {
+  p->stride += HM_GROUP;
+  p->pos = (p->pos + p->stride) & p->mask;
+}
+
+static inline uint32_t hm_probe_slot(hm_probe *p, uint32_t bits) {
+  return (p->pos + __builtin_ctz(bits)) & p->mask;
+}
+
+#define DefineHashMap(type, key_type, value_type, hash_fn, eq_fn)             \
+  typedef struct type##_entry {                                               \
+    key_type key;                                                             \
+    value_type value;                                                         \
+  } type##_entry;                                                             \
+                                                                              \
+  typedef struct type {                                                       \
+    uint8_t *ctrl;          /* capacity + HM_GROUP control bytes */           \
+    uint32_t *slots;        /* entry index of each full slot */               \
+    type##_entry *entries;  /* dense, HM_MAX_LEN(capacity) */                 \
+    uint32_t len, capacity, growth_left;                                      \
+  } type;                                                                     \
+                                                                              \
+  /* Slot of key, or -1 */                                                    \
+  static inline int64_t _##type##_find(type *m, key_type key, uint64_t h) {   \
+    if(!m->len) return -1;                                                    \
+    hm_probe p = hm_probe_start(h, m->capacity);                              \
+    for(;;) {                                                                 \
+      const uint8_t *g = m->ctrl + p.pos;                                     \
+      for(uint32_t bits = hm_match(g, HM_H2(h)); bits; bits &= bits - 1) {    \
+        uint32_t s = hm_probe_slot(&p, bits);                                 \
+        if(eq_fn(m->entries[m->slots[s]].key, key)) return s;                 \
+      }                                                                       \
+      if(hm_match(g, HM_EMPTY)) return -1;                                    \
+      hm_probe_next(&p);                                                      \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  static inline uint32_t _##type##_find_free(type *m, uint64_t h) {           \
+    hm_probe p = hm_probe_start(h, m->capacity);                              \
+    for(;;) {                                                                 \
+      uint32_t bits = hm_match_free(m->ctrl + p.pos);                         \
+      if(bits) return hm_probe_slot(&p, bits);                                \
+      hm_probe_next(&p);                                                      \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  /* Rebuild slots for a new capacity, drops DELETED markers */               \
+  static inline void _##type##_rehash(type *m, uint32_t capacity) {           \
+    uint8_t *mem = malloc((size_t) capacity * sizeof(uint32_t) +              \
+                          capacity + HM_GROUP);                               \
+    type##_entry *entries =                                                   \
+        realloc(m->entries, HM_MAX_LEN(capacity) * sizeof(type##_entry));     \
+    if(!mem || !entries) {                                                    \
+      fprintf(stderr, "[ERROR] Could not grow hash map to %u\n", capacity);   \
+      exit(1);                                                                \
+    }                                                                         \
+    free(m->slots);                                                           \
+    m->slots = (uint32_t *) mem;                                              \
+    m->ctrl = mem + (size_t) capacity * sizeof(uint32_t);                     \
+    m->entries = entries;                                                     \
+    m->capacity = capacity;                                                   \
+    memset(m->ctrl, HM_EMPTY, capacity + HM_GROUP);                           \
+    for(uint32_t i = 0; i < m->len; i++) {                                    \
+      uint64_t h = hash_fn(m->entries[i].key);                                \
+      uint32_t s = _##type##_find_free(m, h);                                 \
+      hm_set_ctrl(m->ctrl, capacity, s, HM_H2(h));                            \
+      m->slots[s] = i;                                                        \
+    }                                                                         \
+    m->growth_left = HM_MAX_LEN(capacity) - m->len;                           \
+  }                                                                           \
+                                                                              \
+  static inline void type##_reserve(type *m, uint32_t n) {                    \
+    uint32_t capacity = HM_MIN_CAPACITY;                                      \
+    while(HM_MAX_LEN(capacity) < n) capacity *= 2;                            \
+    if(capacity > m->capacity) _##type##_rehash(m, capacity);                 \
+  }                                                                           \
+                                                                              \
+  static inline type##_entry *type##_getp(type *m, key_type key) {            \
+    int64_t s = _##type##_find(m, key, hash_fn(key));                         \
+    return s < 0 ? NULL : &m->entries[m->slots[s]];                           \
+  }                                                                           \
+                                                                              \
+  static inline value_type type##_get(type *m, key_type key,                  \
+                                      value_type dflt) {                      \
+    type##_entry *e = type##_getp(m, key);                                    \
+    return e ? e->value : dflt;                                               \
+  }                                                                           \
+                                                                              \
+  static inline type##_entry *type##_put(type *m, key_type key,               \
+                                         value_type value) {                  \
+    uint64_t h = hash_fn(key);                                                \
+    int64_t found = _##type##_find(m, key, h);                                \
+    if(found >= 0) {                                                          \
+      type##_entry *e = &m->entries[m->slots[found]];                         \
+      e->value = value;                                                       \
+      return e;                                                               \
+    }                                                                         \
+    if(!m->growth_left) {                                                     \
+      /* grow when mostly live entries, otherwise just clear DELETED */       \
+      uint32_t capacity = m->capacity ? m->capacity : HM_MIN_CAPACITY;        \
+      if((uint64_t) m->len * 32 > (uint64_t) capacity * 25) capacity *= 2;     \
+      _##type##_rehash(m, capacity);                                          \
+    }                                                                         \
+    uint32_t s = _##type##_find_free(m, h);                                   \
+    if(m->ctrl[s] == HM_EMPTY) m->growth_left--;                              \
+    hm_set_ctrl(m->ctrl, m->capacity, s, HM_H2(h));                           \
+    m->slots[s] = m->len;                                                     \
+    type##_entry *e = &m->entries[m->len++];                                  \
+    e->key = key;                                                             \
+    e->value = value;                                                         \
+    return e;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline bool type##_del(type *m, key_type key) {                      \
+    int64_t s = _##type##_find(m, key, hash_fn(key));                         \
+    if(s < 0) return false;                                                   \
+    uint32_t idx = m->slots[s], last = m->len - 1;                            \
+    hm_set_ctrl(m->ctrl, m->capacity, s, HM_DELETED);                         \
+    if(idx != last) {                                                         \
+      /* move last entry in place and point its slot to it */                 \
+      m->entries[idx] = m->entries[last];                                     \
+      uint64_t h = hash_fn(m->entries[idx].key);                              \
+      hm_probe p = hm_probe_start(h, m->capacity);                            \
+      for(bool moved = false; !moved; hm_probe_next(&p)) {                    \
+        uint32_t bits = hm_match(m->ctrl + p.pos, HM_H2(h));                  \
+        for(; bits; bits &= bits - 1) {                                       \
+          uint32_t ls = hm_probe_slot(&p, bits);                              \
+          if(m->slots[ls] == last) {                                          \
+            m->slots[ls] = idx;                                               \
+            moved = true;                                                     \
+            break;                                                            \
+          }                                                                   \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+    m->len--;                                                                 \
+    return true;                                                              \
+  }                                                                           \
+                                                                              \
+  static inline void type##_free(type *m) {                                   \
+    free(m->slots);                                                           \
+    free(m->entries);                                                         \
+    *m = (type){0};                                                           \
+  }
+
+#endif
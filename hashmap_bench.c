@@ -0,0 +1,198 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#define HASH_IMPLEMENTATION
+#include "hashmap.h"
+
+/* Compare hashmap.h with the stb_ds maps it replaced, on keys like the
+ * servers use: plates (car_table), session ids (sessions) and job ids
+ * (job_status_by_id).
+ * usage: hashmap_bench [entries]
+ * build optimized, build.sh makes a debug build:
+ *   cc -O2 -std=gnu11 hashmap_bench.c -o hashmap_bench
+ *
+ * The stb_ds rows need the stb submodule, without it only hashmap.h runs.
+ * Prints ns per insert, lookup of a present key and of a missing key,
+ * and heap bytes per entry. */
+
+#if __has_include("stb/stb_ds.h")
+#define HAVE_STB
+#define STB_DS_IMPLEMENTATION
+#include "stb/stb_ds.h"
+#endif
+
+DefineHashMap(str_map, const char *, int, hm_hash_str, hm_str_eq);
+DefineHashMap(int_map, uint32_t, int, hm_hash_int, hm_int_eq);
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// large blocks are mmapped by malloc, count those too
+static size_t heap_used(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static volatile long sink; // keeps the lookups from being optimized out
+
+typedef struct result {
+  double insert, hit, miss, bytes;
+} result;
+
+static void report(const char *keys, const char *map, result r) {
+  printf("%-12s %-10s insert %6.1f  hit %6.1f  miss %6.1f ns   %5.1f bytes/entry\n",
+         keys, map, r.insert, r.hit, r.miss, r.bytes);
+}
+
+/* Keys and lookup order, present[] are inserted, absent[] never are */
+typedef struct keys {
+  uint32_t n;
+  char **str_present, **str_absent;
+  uint32_t *int_present, *int_absent;
+  uint32_t *order; // random permutation for lookups
+} keys;
+
+static char *random_plate(void) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  int len = 4 + rand() % 4;
+  char *p = malloc(len + 1);
+  for(int i = 0; i < len; i++) p[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+  p[len] = 0;
+  return p;
+}
+
+/* Plates are random, so a few may repeat, both maps see the same keys */
+static void make_keys(keys *k, uint32_t n, bool sequential) {
+  k->n = n;
+  k->str_present = malloc(n * sizeof(char *));
+  k->str_absent = malloc(n * sizeof(char *));
+  k->int_present = malloc(n * sizeof(uint32_t));
+  k->int_absent = malloc(n * sizeof(uint32_t));
+  k->order = malloc(n * sizeof(uint32_t));
+  for(uint32_t i = 0; i < n; i++) {
+    k->str_present[i] = random_plate();
+    k->str_absent[i] = random_plate();
+    k->str_absent[i][0] = 'a'; // lower case never appears in present plates
+    // session ids are random, job ids count up
+    k->int_present[i] = sequential ? i + 1 : ((uint32_t) rand() << 1) | 1;
+    k->int_absent[i] = sequential ? n + i + 1 : (uint32_t) rand() << 1;
+    k->order[i] = i;
+  }
+  for(uint32_t i = n - 1; i > 0; i--) {
+    uint32_t j = rand() % (i + 1), t = k->order[i];
+    k->order[i] = k->order[j];
+    k->order[j] = t;
+  }
+}
+
+static result bench_str_map(keys *k) {
+  result r;
+  size_t heap = heap_used();
+  str_map m = {0};
+  double t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) str_map_put(&m, k->str_present[i], i);
+  r.insert = (now_ns() - t) / k->n;
+  r.bytes = (double) (heap_used() - heap) / m.len;
+  long sum = 0;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += str_map_get(&m, k->str_present[k->order[i]], -1);
+  r.hit = (now_ns() - t) / k->n;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += str_map_get(&m, k->str_absent[i], -1);
+  r.miss = (now_ns() - t) / k->n;
+  sink = sum;
+  str_map_free(&m);
+  return r;
+}
+
+static result bench_int_map(keys *k) {
+  result r;
+  size_t heap = heap_used();
+  int_map m = {0};
+  double t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) int_map_put(&m, k->int_present[i], i);
+  r.insert = (now_ns() - t) / k->n;
+  r.bytes = (double) (heap_used() - heap) / m.len;
+  long sum = 0;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += int_map_get(&m, k->int_present[k->order[i]], -1);
+  r.hit = (now_ns() - t) / k->n;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += int_map_get(&m, k->int_absent[i], -1);
+  r.miss = (now_ns() - t) / k->n;
+  sink = sum;
+  int_map_free(&m);
+  return r;
+}
+
+#ifdef HAVE_STB
+static result bench_stb_str(keys *k) {
+  result r;
+  size_t heap = heap_used();
+  struct { char *key; int value; } *m = NULL;
+  double t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) shput(m, k->str_present[i], i);
+  r.insert = (now_ns() - t) / k->n;
+  r.bytes = (double) (heap_used() - heap) / shlen(m);
+  long sum = 0;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += shgeti(m, k->str_present[k->order[i]]);
+  r.hit = (now_ns() - t) / k->n;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += shgeti(m, k->str_absent[i]);
+  r.miss = (now_ns() - t) / k->n;
+  sink = sum;
+  shfree(m);
+  return r;
+}
+
+static result bench_stb_int(keys *k) {
+  result r;
+  size_t heap = heap_used();
+  struct { uint32_t key; int value; } *m = NULL;
+  double t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) hmput(m, k->int_present[i], i);
+  r.insert = (now_ns() - t) / k->n;
+  r.bytes = (double) (heap_used() - heap) / hmlen(m);
+  long sum = 0;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += hmgeti(m, k->int_present[k->order[i]]);
+  r.hit = (now_ns() - t) / k->n;
+  t = now_ns();
+  for(uint32_t i = 0; i < k->n; i++) sum += hmgeti(m, k->int_absent[i]);
+  r.miss = (now_ns() - t) / k->n;
+  sink = sum;
+  hmfree(m);
+  return r;
+}
+#endif
+
+int main(int argc, char **argv) {
+  uint32_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  if(n < 2) n = 2;
+  srand(42);
+  keys random, sequential;
+  make_keys(&random, n, false);
+  make_keys(&sequential, n, true);
+
+  printf("%u entries\n", n);
+  report("plates", "hashmap.h", bench_str_map(&random));
+#ifdef HAVE_STB
+  report("plates", "stb_ds", bench_stb_str(&random));
+#endif
+  report("session ids", "hashmap.h", bench_int_map(&random));
+#ifdef HAVE_STB
+  report("session ids", "stb_ds", bench_stb_int(&random));
+#endif
+  report("job ids", "hashmap.h", bench_int_map(&sequential));
+#ifdef HAVE_STB
+  report("job ids", "stb_ds", bench_stb_int(&sequential));
+#else
+  printf("stb/stb_ds.h not found (git submodule update --init), stb_ds not measured\n");
+#endif
+  return 0;
+}
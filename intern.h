@@ -0,0 +1,183 @@
+#ifndef intern_h
+#define intern_h
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* == String interning ==
+ * Maps strings to a canonical copy with a small integer id. Interned
+ * strings are NUL terminated, never freed and never move, so they can be
+ * compared and hashed by pointer (or id).
+ *
+ * Lookups of already interned strings take no lock: the table is only
+ * appended to and is replaced (not modified) when it grows. Adding a new
+ * string takes a mutex. Strings are stored in an arena.
+ *
+ * Needs ARENA_IMPLEMENTATION and HASH_IMPLEMENTATION in the program.
+ */
+
+/* Canonical copy of string, interning it if needed. NULL if out of memory. */
+const char *intern(const char *str, size_t len);
+
+/* Like intern for NUL terminated strings */
+#define intern_cstr(str) intern((str), strlen(str))
+
+/* Canonical copy of string if it has been interned, otherwise NULL */
+const char *intern_lookup(const char *str, size_t len);
+
+/* Id of an interned string, ids are dense starting from 0 */
+uint32_t intern_id(const char *interned);
+
+/* Length of an interned string */
+uint32_t intern_len(const char *interned);
+
+/* Interned string by id, NULL if no such id */
+const char *intern_str(uint32_t id);
+
+/* Number of interned strings */
+uint32_t intern_count(void);
+#endif
+
+#ifdef INTERN_IMPLEMENTATION
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+#include "hash.h"
+
+typedef struct intern_hdr {
+  uint64_t hash;
+  uint32_t id, len;
+  char str[]; // len bytes and NUL
+} intern_hdr;
+
+typedef struct intern_table {
+  size_t mask;
+  size_t count;
+  struct intern_table *old; // previous tables, readers may still use them
+  _Atomic(intern_hdr *) slots[];
+} intern_table;
+
+#define INTERN_INITIAL_SIZE 1024
+#define INTERN_CHUNK 4096 // ids per chunk of the id table
+#define INTERN_MAX_CHUNKS 4096
+
+static struct {
+  pthread_mutex_t lock; // writers
+  arena a;
+  _Atomic(intern_table *) table;
+  _Atomic(intern_hdr **) chunks[INTERN_MAX_CHUNKS];
+  atomic_uint count;
+} _intern = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define intern_hdr_of(s) ((intern_hdr *) ((s) - offsetof(intern_hdr, str)))
+
+static intern_hdr *intern_find(intern_table *t, const char *str, size_t len,
+                               uint64_t h) {
+  if(!t) return NULL;
+  for(size_t i = h & t->mask;; i = (i + 1) & t->mask) {
+    intern_hdr *e = atomic_load_explicit(&t->slots[i], memory_order_acquire);
+    if(!e) return NULL;
+    if(e->hash == h && e->len == len && memcmp(e->str, str, len) == 0) return e;
+  }
+}
+
+static intern_table *intern_table_new(size_t size) {
+  intern_table *t = calloc(1, sizeof(intern_table) + size * sizeof(intern_hdr *));
+  if(t) t->mask = size - 1;
+  return t;
+}
+
+static void intern_table_add(intern_table *t, intern_hdr *e) {
+  size_t i = e->hash & t->mask;
+  while(atomic_load_explicit(&t->slots[i], memory_order_relaxed)) i = (i + 1) & t->mask;
+  atomic_store_explicit(&t->slots[i], e, memory_order_release);
+  t->count++;
+}
+
+/* Add new string, called with the lock held */
+static intern_hdr *intern_add(const char *str, size_t len, uint64_t h) {
+  intern_table *t = atomic_load_explicit(&_intern.table, memory_order_relaxed);
+  if(!t || (t->count + 1) * 2 > t->mask + 1) {
+    // grow to a new table and publish it, old one is kept for readers
+    intern_table *nt = intern_table_new(t ? (t->mask + 1) * 2 : INTERN_INITIAL_SIZE);
+    if(!nt) return NULL;
+    if(t) {
+      for(size_t i = 0; i <= t->mask; i++) {
+        intern_hdr *e = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+        if(e) intern_table_add(nt, e);
+      }
+      nt->old = t;
+    }
+    atomic_store_explicit(&_intern.table, nt, memory_order_release);
+    t = nt;
+  }
+
+  uint32_t id = atomic_load_explicit(&_intern.count, memory_order_relaxed);
+  uint32_t chunk = id / INTERN_CHUNK;
+  if(chunk >= INTERN_MAX_CHUNKS) {
+    fprintf(stderr, "[ERROR] Too many interned strings\n");
+    return NULL;
+  }
+  intern_hdr **ids = atomic_load_explicit(&_intern.chunks[chunk], memory_order_relaxed);
+  if(!ids) {
+    ids = new(&_intern.a, intern_hdr *, INTERN_CHUNK);
+    if(!ids) return NULL;
+    atomic_store_explicit(&_intern.chunks[chunk], ids, memory_order_release);
+  }
+
+  intern_hdr *e = arena_alloc_uninit(&_intern.a, sizeof(intern_hdr) + len + 1,
+                                     alignof(intern_hdr), 1);
+  if(!e) return NULL;
+  e->hash = h;
+  e->id = id;
+  e->len = len;
+  memcpy(e->str, str, len);
+  e->str[len] = 0;
+
+  ids[id % INTERN_CHUNK] = e;
+  atomic_store_explicit(&_intern.count, id + 1, memory_order_release);
+  intern_table_add(t, e);
+  return e;
+}
+
+const char *intern_lookup(const char *str, size_t len) {
+  uint64_t h = hash(str, len);
+  intern_hdr *e = intern_find(atomic_load_explicit(&_intern.table, memory_order_acquire),
+                              str, len, h);
+  return e ? e->str : NULL;
+}
+
+const char *intern(const char *str, size_t len) {
+  if(len > UINT32_MAX) return NULL;
+  uint64_t h = hash(str, len);
+  intern_hdr *e = intern_find(atomic_load_explicit(&_intern.table, memory_order_acquire),
+                              str, len, h);
+  if(e) return e->str;
+
+  pthread_mutex_lock(&_intern.lock);
+  // check again, someone may have added it (or grown the table) meanwhile
+  e = intern_find(atomic_load_explicit(&_intern.table, memory_order_relaxed), str, len, h);
+  if(!e) e = intern_add(str, len, h);
+  pthread_mutex_unlock(&_intern.lock);
+  return e ? e->str : NULL;
+}
+
+uint32_t intern_id(const char *interned) { return intern_hdr_of(interned)->id; }
+
+uint32_t intern_len(const char *interned) { return intern_hdr_of(interned)->len; }
+
+const char *intern_str(uint32_t id) {
+  if(id >= atomic_load_explicit(&_intern.count, memory_order_acquire)) return NULL;
+  intern_hdr **ids = atomic_load_explicit(&_intern.chunks[id / INTERN_CHUNK],
+                                          memory_order_acquire);
+  return ids[id % INTERN_CHUNK]->str;
+}
+
+uint32_t intern_count(void) {
+  return atomic_load_explicit(&_intern.count, memory_order_acquire);
+}
+
+#endif
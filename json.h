@@ -44,6 +44,27 @@ bool json_skip(char **pos);
 /* JSON raw, skip any JSON value but return a copy of its raw data (allocates) */
 bool json_raw(char **pos, char **raw);
 
+/* Slice pointing into the parsed input, not nul terminated.
+ * Only valid as long as the input buffer is. */
+typedef struct json_slice {
+  char *data;
+  size_t len;
+} json_slice;
+
+/* Read string and return a slice of it (unescapes in place, no copy) */
+bool json_string_slice(char **pos, json_slice *value);
+
+/* Skip any JSON value and return a slice of its raw data (no copy) */
+bool json_raw_slice(char **pos, json_slice *raw);
+
+/* Compare slice to a C string */
+bool json_slice_eq(json_slice s, const char *str);
+
+#ifdef arena_h
+/* JSON raw, but copy raw data to arena instead of malloc */
+bool json_raw_arena(arena *a, char **pos, char **raw);
+#endif
+
 #define json_field(name, parser, to)                                    \
   if (strcmp(name, _json_field) == 0) {                                 \
     if (!parser(_json_obj, to)) {                                       \
@@ -316,6 +337,21 @@ static Str parse_string(char *at) {
 
 }
 
+/* Skip over string contents without unescaping (doesn't modify input),
+ * at points to the first char after the opening quote. */
+static Str skip_string(char *at) {
+  char *end = at;
+  while(*end != '"') {
+    if(*end == 0) return (Str) { false, 0, 0, 0 };
+    if(*end == '\\') {
+      end++;
+      if(*end == 0) return (Str) { false, 0, 0, 0 };
+    }
+    end++;
+  }
+  return (Str) { true, at, end-at, end+1 };
+}
+
 // read simple '"' delimited string of maxlen
 bool json_string(char **pos, size_t maxlen, char *value) {
   if(!json_expect_consume(pos, '"')) return false;
@@ -373,7 +409,7 @@ bool json_skip(char **pos) {
     return json_double(pos, &f);
 
   case '"':
-    s = parse_string(*pos + 1);
+    s = skip_string(*pos + 1);
     if(s.success) {
       *pos = s.after;
       return true;
@@ -389,7 +425,7 @@ bool json_skip(char **pos) {
       }
       first = false;
       if(!json_expect_consume(pos, '"')) return false;
-      s = parse_string(*pos);
+      s = skip_string(*pos);
       if(!s.success) return false;
       *pos = s.after;
       if(!json_expect_consume(pos, ':')) return false;
@@ -428,21 +464,54 @@ bool json_skip(char **pos) {
   return false;
 }
 
-bool json_raw(char **pos, char **raw) {
+bool json_raw_slice(char **pos, json_slice *raw) {
   skipws(pos);
   char *start = *pos;
-  if(json_skip(pos)) {
-    size_t size = *pos - start + 1;
-    char *data = malloc(size);
-    if(!data) {
-      panic("Couldn't allocate %ld bytes of memory for raw JSON object.", size);
-    }
-    memcpy(data, start, size-1);
-    data[size-1] = 0;
-    *raw = data;
-    return true;
+  if(!json_skip(pos)) return false;
+  *raw = (json_slice) { .data = start, .len = *pos - start };
+  return true;
+}
+
+bool json_raw(char **pos, char **raw) {
+  json_slice s;
+  if(!json_raw_slice(pos, &s)) return false;
+  char *data = malloc(s.len + 1);
+  if(!data) {
+    panic("Couldn't allocate %zu bytes of memory for raw JSON object.", s.len + 1);
   }
-  return false;
+  memcpy(data, s.data, s.len);
+  data[s.len] = 0;
+  *raw = data;
+  return true;
+}
+
+#ifdef arena_h
+bool json_raw_arena(arena *a, char **pos, char **raw) {
+  json_slice s;
+  if(!json_raw_slice(pos, &s)) return false;
+  char *data = (char *) arena_alloc(a, s.len + 1, 1, 1);
+  if(!data) {
+    panic("Couldn't allocate %zu bytes of arena memory for raw JSON object.", s.len + 1);
+  }
+  memcpy(data, s.data, s.len);
+  data[s.len] = 0;
+  *raw = data;
+  return true;
+}
+#endif
+
+bool json_string_slice(char **pos, json_slice *value) {
+  if(!json_expect_consume(pos, '"')) return false;
+  Str s = parse_string(*pos);
+  if(!s.success) return false;
+  *value = (json_slice) { .data = s.start, .len = s.len };
+  *pos = s.after;
+  return true;
+}
+
+bool json_slice_eq(json_slice s, const char *str) {
+  size_t len = strlen(str);
+  return s.len == len && memcmp(s.data, str, len) == 0;
 }
 
 bool json_bool(char **pos, bool *b) {
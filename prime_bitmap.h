@@ -0,0 +1,193 @@
+#ifndef prime_bitmap_h
+#define prime_bitmap_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* == Prime bitmap ==
+ * Primality of all numbers below a limit, one bit per number coprime to
+ * 30 (mod 30 wheel), so a byte covers 30 numbers. Up to 2^32 that is
+ * about 137MB.
+ *
+ * Built once with a segmented sieve and written to a file:
+ *   "PRIMEBM1", limit (u64, little endian), bytes...
+ * Servers mmap the file read only and share it between all threads.
+ */
+
+#define PRIME_BITMAP_MAGIC "PRIMEBM1"
+#define PRIME_BITMAP_HEADER 16
+
+typedef struct prime_bitmap {
+  const uint8_t *bits;
+  uint64_t limit; // numbers below this are covered
+  void *map;
+  size_t map_size;
+} prime_bitmap;
+
+/* Sieve all numbers below limit and write them to path.
+ * Returns the number of primes, or -1 on error. */
+int64_t prime_bitmap_write(const char *path, uint64_t limit);
+
+/* Map bitmap file, returns false if it can't be opened or is not valid */
+bool prime_bitmap_open(prime_bitmap *pb, const char *path);
+void prime_bitmap_close(prime_bitmap *pb);
+
+/* bit of each residue mod 30, 0 for residues sharing a factor with 30 */
+static const uint8_t _pb_bit[30] = {
+  0, 1<<0, 0, 0, 0, 0, 0, 1<<1, 0, 0, 0, 1<<2, 0, 1<<3, 0,
+  0, 0, 1<<4, 0, 1<<5, 0, 0, 0, 1<<6, 0, 0, 0, 0, 0, 1<<7
+};
+
+/* 1 if n is prime, 0 if not, -1 if n is not covered by the bitmap */
+static inline int prime_bitmap_test(const prime_bitmap *pb, uint64_t n) {
+  if(n >= pb->limit) return -1;
+  uint8_t bit = _pb_bit[n % 30];
+  if(!bit) return n == 2 || n == 3 || n == 5;
+  return (pb->bits[n / 30] & bit) != 0;
+}
+#endif
+
+#ifdef PRIME_BITMAP_IMPLEMENTATION
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PRIME_BITMAP_SEGMENT (32 * 1024) // bytes sieved at a time, fits L1
+
+// residues coprime to 30 and the gaps to the next one
+static const uint8_t _pb_wheel[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+static const uint8_t _pb_gap[8] = { 6, 4, 2, 4, 2, 4, 6, 2 };
+
+/* Plain sieve of odd primes from 7 up to max, for crossing off segments */
+static uint32_t *_pb_base_primes(uint32_t max, size_t *count) {
+  uint8_t *composite = calloc(max + 1, 1);
+  uint32_t *primes = malloc(sizeof(uint32_t) * (max / 2 + 1));
+  if(!composite || !primes) {
+    free(composite);
+    free(primes);
+    return NULL;
+  }
+  size_t n = 0;
+  for(uint64_t i = 7; i <= max; i += 2) {
+    if(composite[i]) continue;
+    if(i % 3 && i % 5) primes[n++] = i;
+    for(uint64_t j = i * i; j <= max; j += 2 * i) composite[j] = 1;
+  }
+  free(composite);
+  *count = n;
+  return primes;
+}
+
+/* Cross off multiples of p in segment of bytes [lo, lo+len) */
+static void _pb_cross(uint8_t *seg, uint64_t lo, size_t len, uint64_t p) {
+  uint64_t start = lo * 30, end = (lo + len) * 30;
+  // smallest k >= p, k*p >= start, with k coprime to 30 (smaller k have
+  // a smaller prime factor and were crossed off by that)
+  uint64_t k = (start + p - 1) / p;
+  if(k < p) k = p;
+  int w = 0;
+  for(uint64_t base = k - k % 30;; ) {
+    while(w < 8 && base + _pb_wheel[w] < k) w++;
+    if(w < 8) {
+      k = base + _pb_wheel[w];
+      break;
+    }
+    base += 30;
+    w = 0;
+  }
+  for(uint64_t m = k * p; m < end; m += p * _pb_gap[w], w = (w + 1) & 7) {
+    seg[m / 30 - lo] &= ~_pb_bit[m % 30];
+  }
+}
+
+int64_t prime_bitmap_write(const char *path, uint64_t limit) {
+  uint64_t bytes = (limit + 29) / 30;
+  uint64_t root = 1;
+  while(root * root < limit) root++;
+
+  size_t nprimes;
+  uint32_t *primes = _pb_base_primes(root, &nprimes);
+  uint8_t *seg = malloc(PRIME_BITMAP_SEGMENT);
+  FILE *out = fopen(path, "wb");
+  int64_t count = -1;
+  if(!primes || !seg || !out) {
+    perror("prime_bitmap_write");
+    goto done;
+  }
+
+  uint8_t hdr[PRIME_BITMAP_HEADER];
+  memcpy(hdr, PRIME_BITMAP_MAGIC, 8);
+  for(int i = 0; i < 8; i++) hdr[8 + i] = limit >> (8 * i);
+  if(fwrite(hdr, 1, sizeof(hdr), out) != sizeof(hdr)) goto write_error;
+
+  count = limit > 2 ? (limit > 3 ? (limit > 5 ? 3 : 2) : 1) : 0; // 2, 3 and 5
+  for(uint64_t lo = 0; lo < bytes; lo += PRIME_BITMAP_SEGMENT) {
+    size_t len = bytes - lo < PRIME_BITMAP_SEGMENT ? bytes - lo : PRIME_BITMAP_SEGMENT;
+    memset(seg, 0xFF, len);
+    if(lo == 0) seg[0] &= ~1; // 1 is not prime
+    for(size_t i = 0; i < nprimes && (uint64_t) primes[i] * primes[i] < (lo + len) * 30; i++) {
+      _pb_cross(seg, lo, len, primes[i]);
+    }
+    if(lo + len == bytes) {
+      // clear numbers past the limit in the last byte
+      for(uint64_t n = limit; n < bytes * 30; n++) seg[len - 1] &= ~_pb_bit[n % 30];
+    }
+    for(size_t i = 0; i < len; i++) count += __builtin_popcount(seg[i]);
+    if(fwrite(seg, 1, len, out) != len) goto write_error;
+  }
+  if(fclose(out) != 0) {
+    out = NULL;
+    goto write_error;
+  }
+  out = NULL;
+  goto done;
+
+ write_error:
+  perror("prime_bitmap_write");
+  count = -1;
+ done:
+  if(out) fclose(out);
+  free(primes);
+  free(seg);
+  return count;
+}
+
+bool prime_bitmap_open(prime_bitmap *pb, const char *path) {
+  memset(pb, 0, sizeof(prime_bitmap));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return false;
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < PRIME_BITMAP_HEADER) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return false;
+
+  const uint8_t *hdr = map;
+  uint64_t limit = 0;
+  for(int i = 0; i < 8; i++) limit |= (uint64_t) hdr[8 + i] << (8 * i);
+  if(memcmp(hdr, PRIME_BITMAP_MAGIC, 8) != 0 ||
+     (uint64_t) st.st_size < PRIME_BITMAP_HEADER + (limit + 29) / 30) {
+    fprintf(stderr, "[ERROR] %s is not a valid prime bitmap\n", path);
+    munmap(map, st.st_size);
+    return false;
+  }
+  madvise(map, st.st_size, MADV_RANDOM); // lookups are scattered, don't read ahead
+  pb->map = map;
+  pb->map_size = st.st_size;
+  pb->bits = hdr + PRIME_BITMAP_HEADER;
+  pb->limit = limit;
+  return true;
+}
+
+void prime_bitmap_close(prime_bitmap *pb) {
+  if(pb->map) munmap(pb->map, pb->map_size);
+  memset(pb, 0, sizeof(prime_bitmap));
+}
+#endif
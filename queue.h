@@ -0,0 +1,307 @@
+#ifndef queue_h
+#define queue_h
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* == Lock free ring buffers ==
+ * spsc_queue: one producer and one consumer thread, can push and pop
+ * many elements at once (byte streams).
+ * mpmc_queue: any number of producers and consumers (Vyukov's bounded
+ * queue, each cell has a sequence number telling whose turn it is).
+ *
+ * Both are bounded, capacity is rounded up to a power of 2 and push
+ * fails when full. Element size is given at init, elements are copied.
+ * Producer and consumer positions are on separate cache lines.
+ *
+ * Consumers can block with *_pop_wait, they sleep on a futex and are
+ * woken by the next push (or by queue_notify).
+ */
+
+#define QUEUE_CACHE_LINE 64
+
+/* Futex that consumers sleep on, producers only make a syscall if
+ * someone sleeps. */
+typedef struct queue_waiter {
+  atomic_uint seq;
+  atomic_uint sleepers;
+} queue_waiter;
+
+typedef struct spsc_queue {
+  atomic_size_t head;  // next write position, written by producer
+  size_t tail_cache;   // producer's last seen tail
+  char _pad1[QUEUE_CACHE_LINE - sizeof(atomic_size_t) - sizeof(size_t)];
+  atomic_size_t tail;  // next read position, written by consumer
+  size_t head_cache;   // consumer's last seen head
+  char _pad2[QUEUE_CACHE_LINE - sizeof(atomic_size_t) - sizeof(size_t)];
+  uint8_t *buf;
+  size_t mask, elem_size;
+  bool owned; // buf was allocated by init
+  queue_waiter waiter;
+} spsc_queue;
+
+typedef struct mpmc_queue {
+  atomic_size_t head; // next push position
+  char _pad1[QUEUE_CACHE_LINE - sizeof(atomic_size_t)];
+  atomic_size_t tail; // next pop position
+  char _pad2[QUEUE_CACHE_LINE - sizeof(atomic_size_t)];
+  uint8_t *cells;     // sequence number followed by element
+  size_t mask, elem_size, cell_size;
+  queue_waiter waiter;
+} mpmc_queue;
+
+/* Init with capacity elements of elem_size bytes, returns false if out of memory */
+bool spsc_init(spsc_queue *q, size_t capacity, size_t elem_size);
+
+/* Init using given buffer, capacity must be a power of 2 */
+void spsc_init_buf(spsc_queue *q, void *buf, size_t capacity, size_t elem_size);
+void spsc_free(spsc_queue *q);
+
+/* Push up to n elements, returns how many fit */
+size_t spsc_push_n(spsc_queue *q, const void *elems, size_t n);
+
+/* Pop up to max elements, returns how many were popped */
+size_t spsc_pop_n(spsc_queue *q, void *out, size_t max);
+
+#define spsc_push(q, elem) (spsc_push_n((q), (elem), 1) == 1)
+#define spsc_pop(q, out) (spsc_pop_n((q), (out), 1) == 1)
+
+/* Pop at least one (up to max) element, waiting at most timeout_ms
+ * (-1 is forever). Returns how many were popped, 0 on timeout. */
+size_t spsc_pop_wait(spsc_queue *q, void *out, size_t max, int timeout_ms);
+
+bool mpmc_init(mpmc_queue *q, size_t capacity, size_t elem_size);
+void mpmc_free(mpmc_queue *q);
+bool mpmc_push(mpmc_queue *q, const void *elem);
+bool mpmc_pop(mpmc_queue *q, void *out);
+
+/* Pop, waiting at most timeout_ms (-1 is forever) for an element.
+ * Returns false on timeout or if woken by queue_notify. */
+bool mpmc_pop_wait(mpmc_queue *q, void *out, int timeout_ms);
+
+/* Wake waiting consumers without pushing anything */
+void queue_notify(queue_waiter *w);
+#endif
+
+#ifdef QUEUE_IMPLEMENTATION
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t queue_round_pow2(size_t n) {
+  size_t c = 2;
+  while(c < n) c *= 2;
+  return c;
+}
+
+void queue_notify(queue_waiter *w) {
+  // pairs with the fence in queue_sleep: either we see the sleeper,
+  // or the sleeper sees what was pushed before this
+  atomic_thread_fence(memory_order_seq_cst);
+  if(atomic_load_explicit(&w->sleepers, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&w->seq, 1, memory_order_release);
+    syscall(SYS_futex, &w->seq, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+  }
+}
+
+/* Call before checking the queue a last time, then queue_sleep */
+static unsigned int queue_prepare_sleep(queue_waiter *w) {
+  unsigned int seq = atomic_load_explicit(&w->seq, memory_order_acquire);
+  atomic_fetch_add_explicit(&w->sleepers, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  return seq;
+}
+
+static void queue_cancel_sleep(queue_waiter *w) {
+  atomic_fetch_sub_explicit(&w->sleepers, 1, memory_order_relaxed);
+}
+
+static void queue_sleep(queue_waiter *w, unsigned int seq, int timeout_ms) {
+  struct timespec ts, *tsp = NULL;
+  if(timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    tsp = &ts;
+  }
+  syscall(SYS_futex, &w->seq, FUTEX_WAIT_PRIVATE, seq, tsp, NULL, 0);
+  atomic_fetch_sub_explicit(&w->sleepers, 1, memory_order_relaxed);
+}
+
+static long queue_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void spsc_init_buf(spsc_queue *q, void *buf, size_t capacity, size_t elem_size) {
+  memset(q, 0, sizeof(spsc_queue));
+  q->buf = buf;
+  q->mask = capacity - 1;
+  q->elem_size = elem_size;
+}
+
+bool spsc_init(spsc_queue *q, size_t capacity, size_t elem_size) {
+  capacity = queue_round_pow2(capacity);
+  void *buf = malloc(capacity * elem_size);
+  if(!buf) return false;
+  spsc_init_buf(q, buf, capacity, elem_size);
+  q->owned = true;
+  return true;
+}
+
+void spsc_free(spsc_queue *q) {
+  if(q->owned) free(q->buf);
+  q->buf = NULL;
+}
+
+/* Copy n elements between ring position pos and flat memory */
+static void spsc_copy(spsc_queue *q, size_t pos, void *flat, size_t n, bool to_ring) {
+  size_t cap = q->mask + 1;
+  size_t at = pos & q->mask;
+  size_t first = n < cap - at ? n : cap - at;
+  uint8_t *ring = q->buf + at * q->elem_size;
+  uint8_t *mem = flat;
+  if(to_ring) {
+    memcpy(ring, mem, first * q->elem_size);
+    memcpy(q->buf, mem + first * q->elem_size, (n - first) * q->elem_size);
+  } else {
+    memcpy(mem, ring, first * q->elem_size);
+    memcpy(mem + first * q->elem_size, q->buf, (n - first) * q->elem_size);
+  }
+}
+
+size_t spsc_push_n(spsc_queue *q, const void *elems, size_t n) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t cap = q->mask + 1;
+  if(cap - (head - q->tail_cache) < n) {
+    q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+  }
+  size_t space = cap - (head - q->tail_cache);
+  if(n > space) n = space;
+  if(!n) return 0;
+  spsc_copy(q, head, (void *) elems, n, true);
+  atomic_store_explicit(&q->head, head + n, memory_order_release);
+  queue_notify(&q->waiter);
+  return n;
+}
+
+size_t spsc_pop_n(spsc_queue *q, void *out, size_t max) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if(q->head_cache - tail < max) {
+    q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+  }
+  size_t n = q->head_cache - tail;
+  if(n > max) n = max;
+  if(!n) return 0;
+  spsc_copy(q, tail, out, n, false);
+  atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+  return n;
+}
+
+size_t spsc_pop_wait(spsc_queue *q, void *out, size_t max, int timeout_ms) {
+  long deadline = timeout_ms >= 0 ? queue_now_ms() + timeout_ms : 0;
+  size_t n;
+  while(!(n = spsc_pop_n(q, out, max))) {
+    unsigned int seq = queue_prepare_sleep(&q->waiter);
+    if((n = spsc_pop_n(q, out, max))) {
+      queue_cancel_sleep(&q->waiter);
+      break;
+    }
+    int left = -1;
+    if(timeout_ms >= 0) {
+      left = deadline - queue_now_ms();
+      if(left <= 0) {
+        queue_cancel_sleep(&q->waiter);
+        return 0;
+      }
+    }
+    queue_sleep(&q->waiter, seq, left);
+  }
+  return n;
+}
+
+#define mpmc_cell(q, pos) ((q)->cells + ((pos) & (q)->mask) * (q)->cell_size)
+#define mpmc_seq(cell) ((atomic_size_t *) (cell))
+#define mpmc_data(cell) ((cell) + sizeof(atomic_size_t))
+
+bool mpmc_init(mpmc_queue *q, size_t capacity, size_t elem_size) {
+  memset(q, 0, sizeof(mpmc_queue));
+  capacity = queue_round_pow2(capacity);
+  q->mask = capacity - 1;
+  q->elem_size = elem_size;
+  q->cell_size = (sizeof(atomic_size_t) + elem_size + 7) & ~(size_t) 7;
+  q->cells = malloc(capacity * q->cell_size);
+  if(!q->cells) return false;
+  for(size_t i = 0; i < capacity; i++) {
+    atomic_init(mpmc_seq(mpmc_cell(q, i)), i);
+  }
+  return true;
+}
+
+void mpmc_free(mpmc_queue *q) {
+  free(q->cells);
+  q->cells = NULL;
+}
+
+bool mpmc_push(mpmc_queue *q, const void *elem) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  uint8_t *cell;
+  for(;;) {
+    cell = mpmc_cell(q, pos);
+    size_t seq = atomic_load_explicit(mpmc_seq(cell), memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if(diff == 0) {
+      // cell is free for this position, claim it
+      if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if(diff < 0) {
+      return false; // full, cell not yet consumed from the previous round
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+  memcpy(mpmc_data(cell), elem, q->elem_size);
+  atomic_store_explicit(mpmc_seq(cell), pos + 1, memory_order_release);
+  queue_notify(&q->waiter);
+  return true;
+}
+
+bool mpmc_pop(mpmc_queue *q, void *out) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  uint8_t *cell;
+  for(;;) {
+    cell = mpmc_cell(q, pos);
+    size_t seq = atomic_load_explicit(mpmc_seq(cell), memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+    if(diff == 0) {
+      if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if(diff < 0) {
+      return false; // empty
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+  memcpy(out, mpmc_data(cell), q->elem_size);
+  // free the cell for the push one round later
+  atomic_store_explicit(mpmc_seq(cell), pos + q->mask + 1, memory_order_release);
+  return true;
+}
+
+bool mpmc_pop_wait(mpmc_queue *q, void *out, int timeout_ms) {
+  if(mpmc_pop(q, out)) return true;
+  unsigned int seq = queue_prepare_sleep(&q->waiter);
+  if(mpmc_pop(q, out)) {
+    queue_cancel_sleep(&q->waiter);
+    return true;
+  }
+  queue_sleep(&q->waiter, seq, timeout_ms);
+  return mpmc_pop(q, out);
+}
+#endif
@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdatomic.h>
+#include <stdarg.h>
+#include "arena.h"
 
 /* thread workers = N worker threads are spawned which handle connections as they come
  * select = single server thread that uses select() to handle multiple clients
@@ -23,8 +25,19 @@
  * that is passed in every time the handler is invoked for the socket.
  *
  * in dgram mode, the dgram_handler is used with a struct dgram param
+ *
+ * reactor = N threads (at most SERVER_MAX_REACTORS), each with its own epoll
+ * set. New connections go to whichever reactor accepts first and stay on it.
+ * Handler is called like in select mode: once on connect and then whenever
+ * the socket is readable (or writable, see server_want_write), it closes
+ * the socket and sets socket to 0 when done. Other threads can wake a reactor with server_wake, it then calls
+ * wakeup_handler with its reactor number (for mailboxes between reactors).
  */
-typedef enum { SERVER_THREAD_WORKERS=0, SERVER_SELECT=1, SERVER_DGRAM } server_type;
+typedef enum { SERVER_THREAD_WORKERS=0, SERVER_SELECT=1, SERVER_DGRAM, SERVER_REACTOR } server_type;
+
+#define SERVER_MAX_REACTORS 64
+#define SERVER_READABLE 1 // also set on hangup and errors
+#define SERVER_WRITABLE 2
 
 typedef struct dgram {
   int socket;
@@ -36,6 +49,8 @@ typedef struct dgram {
 typedef struct conn_state {
   int socket; // if 0, this is a free slot
   void* data;
+  int reactor; // reactor thread of this connection, in reactor mode
+  uint32_t events; // reactor mode: why the handler was called, 0 on connect
 
   // internal, for broadcast
   struct conn_state *_conns;
@@ -56,6 +71,7 @@ typedef struct server {
   atomic_bool shutdown;
   void (*handler)(conn_state*);
   void (*dgram_handler)(dgram*);
+  void (*wakeup_handler)(int reactor);
   void *data;
   server_type type;
   size_t connection_data_size;
@@ -66,12 +82,73 @@ typedef struct server {
 
 
 
+/* Per thread scratch arena for short lived allocations.
+ * The server resets it after every handler invocation (each event in select
+ * and dgram modes, each connection in thread worker mode). Handlers that
+ * loop over many messages can reset it themselves with scratch_reset.
+ * Anything that must outlive the reset is copied out with promote. */
+arena *scratch(void);
+void scratch_reset(void);
+
+/* Copy scratch data to the heap (caller frees) */
+void *promote(const void *data, size_t size);
+char *promote_str(const char *str);
+/* Copy scratch data to a longer lived arena */
+void *promote_to(arena *a, const void *data, size_t size);
+
 #define serve(...) _serve((server) { __VA_ARGS__ })
 void _serve(server s);
 
+/* Reactor mode: have reactor call its wakeup_handler. Wakeups that arrive
+ * before the handler runs are coalesced into one call. */
+void server_wake(int reactor);
+
+/* Reactor mode: also call handler when socket becomes writable (or stop) */
+void server_want_write(conn_state *c, bool want);
+
 int readch(int socket);
 bool read_until(int socket, char *to, char endch, size_t maxlen);
 
+/* Write all data to socket, retrying partial writes. */
+bool write_all(int socket, const void *data, size_t len);
+
+/* Buffered line reader for line based protocols.
+ * A single read can yield multiple lines when the client pipelines requests.
+ */
+typedef struct line_reader {
+  int socket;
+  char *buf;
+  size_t size;  // buffer capacity, max line length is size-1
+  size_t start; // start of unconsumed data
+  size_t end;   // end of data read so far
+} line_reader;
+
+/* Read more data from the socket (blocks).
+ * Returns false on EOF, error or if a single line doesn't fit the buffer. */
+bool line_reader_fill(line_reader *lr);
+
+/* Return the next complete line already in the buffer, without reading.
+ * The newline is replaced with nul. Returns NULL if there is no complete line.
+ * Returned lines are valid until the next line_reader_fill call. */
+char *line_reader_next(line_reader *lr, size_t *len);
+
+/* Reactor mode: read what is available without blocking. Returns false on
+ * EOF, error or a line that doesn't fit, true even if nothing was read. */
+bool line_reader_fill_nb(line_reader *lr);
+
+/* Output buffer to coalesce multiple responses into a single write. */
+typedef struct write_buffer {
+  int socket;
+  char *buf;
+  size_t size; // buffer capacity
+  size_t len;  // bytes pending
+} write_buffer;
+
+bool wbuf_write(write_buffer *wb, const void *data, size_t len);
+bool wbuf_printf(write_buffer *wb, const char *fmt, ...);
+/* Send all pending data */
+bool wbuf_flush(write_buffer *wb);
+
 #define VA_ARGS(...) , ##__VA_ARGS__
 #define err(fmt, ...) fprintf(stderr, "[ERROR] " fmt "\n" VA_ARGS(__VA_ARGS__))
 #ifdef DEBUG
@@ -84,6 +161,37 @@ bool read_until(int socket, char *to, char endch, size_t maxlen);
 #endif
 
 #ifdef SERVER_IMPLEMENTATION
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+static _Thread_local arena _scratch;
+
+arena *scratch(void) { return &_scratch; }
+
+void scratch_reset(void) { arena_clear(&_scratch); }
+
+void *promote(const void *data, size_t size) {
+  void *p = malloc(size);
+  if(!p) {
+    err("Could not promote %zu bytes to heap", size);
+    return NULL;
+  }
+  memcpy(p, data, size);
+  return p;
+}
+
+char *promote_str(const char *str) {
+  return str ? promote(str, strlen(str) + 1) : NULL;
+}
+
+void *promote_to(arena *a, const void *data, size_t size) {
+  void *p = arena_alloc_uninit(a, size, alignof(max_align_t), 1);
+  if(p) memcpy(p, data, size);
+  return p;
+}
 
 void _server_worker(server_worker_args *args) {
   struct sockaddr_in client_addr;
@@ -100,12 +208,165 @@ void _server_worker(server_worker_args *args) {
     conn_state cs = {.socket = client_socket, .data = args->data };
     //dbg("CALLING HANDLER");
     args->handler(&cs);
+    scratch_reset();
     //dbg("HANDLER DONE");
     close(client_socket);
     //dbg("CONN DONE");
   }
 }
 
+typedef struct _reactor {
+  int id;
+  int epfd;
+  int wakefd; // eventfd for server_wake
+  atomic_bool wake_pending;
+  int server_fd;
+  int spare_fd; // given up to accept and drop a connection when out of fds
+  server *s;
+  pthread_t thread;
+} _reactor;
+
+static _reactor _reactors[SERVER_MAX_REACTORS];
+
+void server_wake(int reactor) {
+  _reactor *r = &_reactors[reactor];
+  if(!atomic_exchange(&r->wake_pending, true)) {
+    uint64_t one = 1;
+    write(r->wakefd, &one, 8);
+  }
+}
+
+void server_want_write(conn_state *c, bool want) {
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0), .data.ptr = c};
+  if(epoll_ctl(_reactors[c->reactor].epfd, EPOLL_CTL_MOD, c->socket, &ev) < 0) perror("epoll_ctl");
+}
+
+static void _reactor_handle(_reactor *r, conn_state *c, uint32_t events) {
+  c->events = 0;
+  if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->events |= SERVER_READABLE;
+  if(events & EPOLLOUT) c->events |= SERVER_WRITABLE;
+  r->s->handler(c);
+  scratch_reset();
+  if(c->socket == 0) {
+    // handler closed it, which also removed it from epoll
+    free(c->data);
+    free(c);
+  }
+}
+
+/* Out of file descriptors the listen socket stays readable, and every
+ * reactor would spin on it. Use the spare descriptor to accept the
+ * connection and close it right away. Returns false if there was none. */
+static bool _reactor_drop_connection(_reactor *r) {
+  close(r->spare_fd);
+  int fd = accept(r->server_fd, NULL, NULL);
+  int error = errno;
+  if(fd >= 0) close(fd);
+  r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    if(error != EAGAIN && error != EWOULDBLOCK) err("accept: %s", strerror(error));
+    return false;
+  }
+  err("Out of file descriptors, dropped a connection");
+  return true;
+}
+
+static void _reactor_accept(_reactor *r) {
+  while(1) {
+    int fd = accept(r->server_fd, NULL, NULL);
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if((errno == EMFILE || errno == ENFILE) && r->spare_fd >= 0) {
+        if(_reactor_drop_connection(r)) continue;
+        return;
+      }
+      perror("accept");
+      usleep(10000); // back off, the error is likely to repeat right away
+      return;
+    }
+    conn_state *c = calloc(1, sizeof(conn_state));
+    if(c && r->s->connection_data_size) {
+      c->data = calloc(1, r->s->connection_data_size);
+      if(!c->data) {
+        free(c);
+        c = NULL;
+      }
+    }
+    if(!c) {
+      err("Could not allocate connection state");
+      close(fd);
+      continue;
+    }
+    c->socket = fd;
+    c->reactor = r->id;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+    if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("epoll_ctl");
+      close(fd);
+      free(c->data);
+      free(c);
+      continue;
+    }
+    _reactor_handle(r, c, 0);
+  }
+}
+
+static void *_reactor_loop(_reactor *r) {
+  struct epoll_event events[64];
+  while(1) {
+    int n = epoll_wait(r->epfd, events, 64, -1);
+    if(n < 0) {
+      if(errno != EINTR) perror("epoll_wait");
+      continue;
+    }
+    for(int i = 0; i < n; i++) {
+      void *p = events[i].data.ptr;
+      if(p == &r->server_fd) {
+        _reactor_accept(r);
+      } else if(p == &r->wakefd) {
+        uint64_t count;
+        read(r->wakefd, &count, 8);
+        atomic_store(&r->wake_pending, false);
+        if(r->s->wakeup_handler) r->s->wakeup_handler(r->id);
+        scratch_reset();
+      } else {
+        _reactor_handle(r, p, events[i].events);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void _serve_reactors(server *s, int server_fd) {
+  int n = s->threads > SERVER_MAX_REACTORS ? SERVER_MAX_REACTORS : s->threads;
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+  for(int i = 0; i < n; i++) {
+    _reactor *r = &_reactors[i];
+    r->id = i;
+    r->s = s;
+    r->server_fd = server_fd;
+    r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->epfd < 0 || r->wakefd < 0) {
+      perror("Reactor setup failed");
+      exit(1);
+    }
+    // only one of the reactors waiting is woken for a new connection
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &r->server_fd};
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev = (struct epoll_event) {.events = EPOLLIN, .data.ptr = &r->wakefd};
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev);
+  }
+  for(int i = 0; i < n; i++) {
+    pthread_create(&_reactors[i].thread, NULL, (void*) _reactor_loop, &_reactors[i]);
+  }
+  for(int i = 0; i < n; i++) {
+    pthread_join(_reactors[i].thread, NULL);
+  }
+}
+
 void _serve(server s) {
   if(s.threads == 0) s.threads = 10;
   if(s.backlog == 0) s.backlog = 10;
@@ -204,6 +465,7 @@ void _serve(server s) {
           }
           conns[i]._conns = conns;
           s.handler(&conns[i]);
+          scratch_reset();
         }
       }
       dbg("checking conns!");
@@ -211,9 +473,12 @@ void _serve(server s) {
       for(int i=0;i<MAX_CONNS;i++) {
         if(conns[i].socket > 0 && FD_ISSET(conns[i].socket, &ready)) {
           s.handler(&conns[i]);
+          scratch_reset();
         }
       }
     }
+  } else if(s.type == SERVER_REACTOR) {
+    _serve_reactors(&s, server_fd);
   } else if(s.type == SERVER_DGRAM) {
     while(1) {
 
@@ -227,6 +492,7 @@ void _serve(server s) {
       buf[r] = 0; // nul terminate
       dgram d = {.socket = server_fd, .data = buf, .len = r, .from = &client_addr};
       s.dgram_handler(&d);
+      scratch_reset();
 
     }
 
@@ -259,6 +525,102 @@ bool read_until(int socket, char *to, char endch, size_t maxlen) {
   return false; // unreachable
 }
 
+bool write_all(int socket, const void *data, size_t len) {
+  const char *at = data;
+  while(len > 0) {
+    ssize_t w = write(socket, at, len);
+    if(w < 0 && errno == EINTR) continue;
+    if(w <= 0) return false;
+    at += w;
+    len -= w;
+  }
+  return true;
+}
+
+/* Make room for more data, false if it's all one unfinished line */
+static bool _line_reader_compact(line_reader *lr) {
+  if(lr->start > 0) {
+    // move unconsumed partial line to the front
+    memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+    lr->end -= lr->start;
+    lr->start = 0;
+  }
+  if(lr->end >= lr->size - 1) {
+    err("Line too long, over %zu bytes", lr->size - 1);
+    return false;
+  }
+  return true;
+}
+
+bool line_reader_fill(line_reader *lr) {
+  if(!_line_reader_compact(lr)) return false;
+  ssize_t r;
+  do {
+    r = read(lr->socket, lr->buf + lr->end, lr->size - 1 - lr->end);
+  } while(r < 0 && errno == EINTR);
+  if(r <= 0) return false;
+  lr->end += r;
+  return true;
+}
+
+bool line_reader_fill_nb(line_reader *lr) {
+  if(!_line_reader_compact(lr)) return false;
+  ssize_t r;
+  do {
+    r = recv(lr->socket, lr->buf + lr->end, lr->size - 1 - lr->end, MSG_DONTWAIT);
+  } while(r < 0 && errno == EINTR);
+  if(r < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+  if(r == 0) return false;
+  lr->end += r;
+  return true;
+}
+
+char *line_reader_next(line_reader *lr, size_t *len) {
+  char *line = lr->buf + lr->start;
+  char *nl = memchr(line, '\n', lr->end - lr->start);
+  if(!nl) return NULL;
+  *nl = 0;
+  if(len) *len = nl - line;
+  lr->start = (nl - lr->buf) + 1;
+  return line;
+}
+
+bool wbuf_flush(write_buffer *wb) {
+  if(wb->len == 0) return true;
+  bool ok = write_all(wb->socket, wb->buf, wb->len);
+  wb->len = 0;
+  return ok;
+}
+
+bool wbuf_write(write_buffer *wb, const void *data, size_t len) {
+  if(wb->len + len > wb->size) {
+    if(!wbuf_flush(wb)) return false;
+    // too big to buffer, send directly
+    if(len > wb->size) return write_all(wb->socket, data, len);
+  }
+  memcpy(wb->buf + wb->len, data, len);
+  wb->len += len;
+  return true;
+}
+
+bool wbuf_printf(write_buffer *wb, const char *fmt, ...) {
+  va_list args;
+  for(int attempt = 0; attempt < 2; attempt++) {
+    size_t avail = wb->size - wb->len;
+    va_start(args, fmt);
+    int len = vsnprintf(wb->buf + wb->len, avail, fmt, args);
+    va_end(args);
+    if(len < 0) return false;
+    if((size_t) len < avail) {
+      wb->len += len;
+      return true;
+    }
+    // didn't fit, flush pending and retry with the whole buffer
+    if(wb->len == 0 || !wbuf_flush(wb)) return false;
+  }
+  return false;
+}
+
 #define each_conn_data(c, conn, type, item, body)                              \
   conn_state *__each_conns = (c)->_conns;                                      \
   for (int __each_i = 0; __each_i < MAX_CONNS; __each_i++) {                   \
@@ -0,0 +1,211 @@
+#ifndef slab_h
+#define slab_h
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* == Slab allocator for fixed size objects ==
+ * Objects are carved from large chunks and recycled through free lists,
+ * chunk memory is never returned to the OS.
+ *
+ * Each thread keeps a cache of free objects per slab. The cache is refilled
+ * from (and overflow returned to) the shared depot SLAB_BATCH objects at a
+ * time, so most allocations and frees take no lock. Free objects cached by
+ * a thread are not returned when it exits, meant for long lived threads.
+ *
+ * For variable sized buffers, slab_buf_alloc picks a power of two size class.
+ */
+typedef struct slab {
+  const char *name;
+  size_t size;          // object size as given
+  atomic_int id;        // index of thread cache, assigned on first use
+  pthread_mutex_t lock; // protects depot and chunk
+  void *depot;          // shared free list
+  size_t depot_count;
+  uint8_t *chunk_cur, *chunk_end; // uncarved part of current chunk
+  atomic_long live, high_water;
+} slab;
+
+#define SLAB_MAX 64       // max number of slabs in a program
+#define SLAB_BATCH 32     // objects moved between thread cache and depot
+#define SLAB_CHUNK_SIZE (256 * 1024)
+
+#define SLAB_INIT(name_, size_)                                                \
+  { .name = (name_), .size = (size_), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/* Define a slab for objects of the given type */
+#define DefineSlab(name, type) slab name = SLAB_INIT(#type, sizeof(type))
+
+#define slab_new(s, type) ((type *)slab_alloc(s))
+
+/* Allocate zeroed object */
+void *slab_alloc(slab *s);
+/* Return object to slab */
+void slab_free(slab *s, void *p);
+
+/* Allocate buffer of at most SLAB_BUF_MAX bytes from a size class,
+ * free it with the same size. Larger sizes go to malloc. */
+#define SLAB_BUF_MAX 4096
+void *slab_buf_alloc(size_t size);
+void slab_buf_free(void *p, size_t size);
+
+/* Print live and high water counts of all slabs in use */
+void slab_stats(FILE *out);
+#endif
+
+#if defined(SLAB_IMPLEMENTATION) && !defined(slab_implemented)
+#define slab_implemented
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct slab_free_obj {
+  struct slab_free_obj *next;
+} slab_free_obj;
+
+typedef struct slab_cache {
+  slab_free_obj *free;
+  int count;
+} slab_cache;
+
+static _Thread_local slab_cache _slab_caches[SLAB_MAX];
+static slab *_slabs[SLAB_MAX];
+static atomic_int _slab_count = 0;
+
+// size classes 16, 32, ... SLAB_BUF_MAX
+#define SLAB_BUF_CLASSES 9
+static slab _slab_bufs[SLAB_BUF_CLASSES] = {
+  SLAB_INIT("buf16", 16), SLAB_INIT("buf32", 32), SLAB_INIT("buf64", 64),
+  SLAB_INIT("buf128", 128), SLAB_INIT("buf256", 256), SLAB_INIT("buf512", 512),
+  SLAB_INIT("buf1024", 1024), SLAB_INIT("buf2048", 2048), SLAB_INIT("buf4096", 4096)
+};
+
+static size_t slab_obj_size(slab *s) {
+  size_t size = s->size < sizeof(slab_free_obj) ? sizeof(slab_free_obj) : s->size;
+  return (size + 15) & ~(size_t)15;
+}
+
+static int slab_id(slab *s) {
+  int id = atomic_load_explicit(&s->id, memory_order_acquire);
+  if(id) return id - 1;
+  pthread_mutex_lock(&s->lock);
+  id = atomic_load(&s->id);
+  if(!id) {
+    int idx = atomic_fetch_add(&_slab_count, 1);
+    if(idx >= SLAB_MAX) {
+      fprintf(stderr, "[ERROR] Too many slabs, max is %d\n", SLAB_MAX);
+      abort();
+    }
+    _slabs[idx] = s;
+    id = idx + 1;
+    atomic_store_explicit(&s->id, id, memory_order_release);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return id - 1;
+}
+
+/* Move a batch of objects from depot (or new chunk memory) to cache */
+static bool slab_refill(slab *s, slab_cache *c) {
+  size_t size = slab_obj_size(s);
+  pthread_mutex_lock(&s->lock);
+  for(int i = 0; i < SLAB_BATCH; i++) {
+    slab_free_obj *o;
+    if(s->depot) {
+      o = s->depot;
+      s->depot = o->next;
+      s->depot_count--;
+    } else {
+      if(s->chunk_cur + size > s->chunk_end) {
+        if(i > 0) break; // got some, carve a new chunk on the next refill
+        size_t chunk = size * 8 > SLAB_CHUNK_SIZE ? size * 8 : SLAB_CHUNK_SIZE;
+        uint8_t *mem = malloc(chunk);
+        if(!mem) break;
+        s->chunk_cur = mem;
+        s->chunk_end = mem + chunk;
+      }
+      o = (slab_free_obj *) s->chunk_cur;
+      s->chunk_cur += size;
+    }
+    o->next = c->free;
+    c->free = o;
+    c->count++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return c->free != NULL;
+}
+
+void *slab_alloc(slab *s) {
+  slab_cache *c = &_slab_caches[slab_id(s)];
+  if(!c->free && !slab_refill(s, c)) {
+    fprintf(stderr, "[ERROR] Out of memory for slab %s\n", s->name);
+    return NULL;
+  }
+  slab_free_obj *o = c->free;
+  c->free = o->next;
+  c->count--;
+
+  long live = atomic_fetch_add_explicit(&s->live, 1, memory_order_relaxed) + 1;
+  long hw = atomic_load_explicit(&s->high_water, memory_order_relaxed);
+  while(live > hw &&
+        !atomic_compare_exchange_weak_explicit(&s->high_water, &hw, live,
+                                               memory_order_relaxed,
+                                               memory_order_relaxed));
+  memset(o, 0, s->size);
+  return o;
+}
+
+void slab_free(slab *s, void *p) {
+  if(!p) return;
+  slab_cache *c = &_slab_caches[slab_id(s)];
+  slab_free_obj *o = p;
+  o->next = c->free;
+  c->free = o;
+  c->count++;
+  atomic_fetch_sub_explicit(&s->live, 1, memory_order_relaxed);
+
+  if(c->count >= 2 * SLAB_BATCH) {
+    // cache too big, give a batch back to the depot
+    slab_free_obj *first = c->free, *last = first;
+    for(int i = 1; i < SLAB_BATCH; i++) last = last->next;
+    c->free = last->next;
+    c->count -= SLAB_BATCH;
+    pthread_mutex_lock(&s->lock);
+    last->next = s->depot;
+    s->depot = first;
+    s->depot_count += SLAB_BATCH;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+static int slab_buf_class(size_t size) {
+  int cls = 0;
+  size_t cls_size = 16;
+  while(cls_size < size) {
+    cls_size <<= 1;
+    cls++;
+  }
+  return cls;
+}
+
+void *slab_buf_alloc(size_t size) {
+  if(size > SLAB_BUF_MAX) return malloc(size);
+  return slab_alloc(&_slab_bufs[slab_buf_class(size)]);
+}
+
+void slab_buf_free(void *p, size_t size) {
+  if(size > SLAB_BUF_MAX) free(p);
+  else slab_free(&_slab_bufs[slab_buf_class(size)], p);
+}
+
+void slab_stats(FILE *out) {
+  int count = atomic_load(&_slab_count);
+  for(int i = 0; i < count && i < SLAB_MAX; i++) {
+    slab *s = _slabs[i];
+    fprintf(out, "slab %-16s size: %6zu, live: %8ld, high water: %8ld\n",
+            s->name, s->size, atomic_load(&s->live), atomic_load(&s->high_water));
+  }
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef str_h
+#define str_h
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* == String slices ==
+ * A str points into some other buffer, nothing here allocates.
+ * Searches use memchr or SSE2 compares 16 bytes at a time,
+ * decimal parsing converts 8 digits at a time.
+ */
+typedef struct str {
+  ptrdiff_t len;
+  char *data;
+} str;
+
+#define cstr(X)                                                                \
+  (str) { .data = (X), .len = strlen((X)) }
+
+bool str_eq(str a, str b);
+
+/* Index of first c in s, or -1 */
+ptrdiff_t str_find(str s, char c);
+
+/* Index of first byte in s that is any of the bytes in set, or -1 */
+ptrdiff_t str_find_any(str s, str set);
+
+/* Split at first sep, returns false if there is no sep */
+bool str_split(str in, char sep, str *part, str *rest);
+
+/* Take next sep separated part from in, the last part doesn't need a
+ * trailing sep. Returns false when in is empty.
+ *   str part;
+ *   while(str_next(&in, ',', &part)) { ... }
+ */
+bool str_next(str *in, char sep, str *part);
+
+/* Parse unsigned decimal, false if empty, not all digits or overflows */
+bool str_to_u32(str in, uint32_t *to);
+bool str_to_u64(str in, uint64_t *to);
+#endif
+
+#ifdef STR_IMPLEMENTATION
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+bool str_eq(str a, str b) {
+  if(a.len != b.len) return false;
+  return memcmp(a.data, b.data, a.len) == 0;
+}
+
+ptrdiff_t str_find(str s, char c) {
+  if(s.len <= 0) return -1;
+  char *at = memchr(s.data, c, s.len);
+  return at ? at - s.data : -1;
+}
+
+ptrdiff_t str_find_any(str s, str set) {
+  if(set.len == 1) return str_find(s, set.data[0]);
+  ptrdiff_t i = 0;
+#ifdef __SSE2__
+  if(set.len <= 16) {
+    __m128i sets[16];
+    for(int j = 0; j < set.len; j++) sets[j] = _mm_set1_epi8(set.data[j]);
+    for(; i + 16 <= s.len; i += 16) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *) (s.data + i));
+      __m128i eq = _mm_cmpeq_epi8(chunk, sets[0]);
+      for(int j = 1; j < set.len; j++) eq = _mm_or_si128(eq, _mm_cmpeq_epi8(chunk, sets[j]));
+      int mask = _mm_movemask_epi8(eq);
+      if(mask) return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for(; i < s.len; i++) {
+    if(memchr(set.data, s.data[i], set.len)) return i;
+  }
+  return -1;
+}
+
+bool str_split(str in, char sep, str *part, str *rest) {
+  ptrdiff_t p = str_find(in, sep);
+  if(p < 0) return false;
+  *part = (str) { .len = p, .data = in.data };
+  *rest = (str) { .len = in.len - p - 1, .data = in.data + p + 1 };
+  return true;
+}
+
+bool str_next(str *in, char sep, str *part) {
+  if(in->len <= 0) return false;
+  ptrdiff_t p = str_find(*in, sep);
+  if(p < 0) {
+    *part = *in;
+    *in = (str) { .len = 0, .data = NULL };
+  } else {
+    *part = (str) { .len = p, .data = in->data };
+    *in = (str) { .len = in->len - p - 1, .data = in->data + p + 1 };
+  }
+  return true;
+}
+
+/* 8 ASCII digits (little endian load) to their value, or -1 if any
+ * byte is not a digit */
+static inline int64_t str_parse8(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  // every byte 0x30..0x39: high nibble 3, and adding 6 doesn't carry out of it
+  if((v & 0xF0F0F0F0F0F0F0F0ull) != 0x3030303030303030ull ||
+     ((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) != 0x3030303030303030ull)
+    return -1;
+  v -= 0x3030303030303030ull;
+  v = (v * 10) + (v >> 8); // pairs of digits
+  v = (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+       (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+  return v;
+}
+
+bool str_to_u64(str in, uint64_t *to) {
+  if(in.len <= 0) return false;
+  uint64_t n = 0;
+  ptrdiff_t i = 0;
+  for(; i + 8 <= in.len; i += 8) {
+    int64_t v = str_parse8(in.data + i);
+    if(v < 0) return false;
+    if(__builtin_mul_overflow(n, 100000000ull, &n) || __builtin_add_overflow(n, (uint64_t) v, &n))
+      return false;
+  }
+  for(; i < in.len; i++) {
+    char c = in.data[i];
+    if(c < '0' || c > '9') return false;
+    if(__builtin_mul_overflow(n, 10, &n) || __builtin_add_overflow(n, (uint64_t)(c - '0'), &n))
+      return false;
+  }
+  *to = n;
+  return true;
+}
+
+bool str_to_u32(str in, uint32_t *to) {
+  uint64_t n;
+  if(!str_to_u64(in, &n) || n > UINT32_MAX) return false;
+  *to = n;
+  return true;
+}
+#endif
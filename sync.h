@@ -0,0 +1,362 @@
+#ifndef sync_h
+#define sync_h
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* == Locks ==
+ * Futex based mutex, reader-writer lock and condition variable.
+ * All are zero initialized, no init or destroy needed.
+ *
+ * Contended lockers first spin a while (the spin count adapts to how long
+ * the lock is usually held) and then sleep in the kernel until woken by
+ * the unlocking thread, so there is no polling delay.
+ *
+ * Define SYNC_PROFILE to count acquisitions and contention per lock and
+ * keep a histogram of wait times, print them with sync_print_stats.
+ */
+
+#define SYNC_SPIN_MAX 200
+#define SYNC_HIST_BUCKETS 24 // wait time buckets: <1us, <2us, <4us ...
+
+#ifdef SYNC_PROFILE
+typedef struct sync_stats {
+  const char *name; // lock expression and line of first use
+  atomic_bool registered;
+  atomic_ulong acquired, contended, wait_ns;
+  atomic_ulong hist[SYNC_HIST_BUCKETS];
+} sync_stats;
+#define SYNC_STATS sync_stats stats;
+#define SYNC_STR_(x) #x
+#define SYNC_STR(x) SYNC_STR_(x)
+#define SYNC_NAME(lck) (#lck " @ " __FILE__ ":" SYNC_STR(__LINE__))
+#else
+#define SYNC_STATS
+#define SYNC_NAME(lck) NULL
+#endif
+
+typedef struct mutex {
+  atomic_uint state; // 0 unlocked, 1 locked, 2 locked and maybe waiters
+  atomic_int spins;  // adaptive spin estimate
+  SYNC_STATS
+} mutex;
+
+typedef struct rwlock {
+  atomic_uint state; // reader count, RW_WRITER and RW_WAITING bits
+  atomic_int spins;
+  SYNC_STATS
+} rwlock;
+
+typedef struct condvar {
+  atomic_uint seq; // bumped on every signal
+} condvar;
+
+#define RW_WRITER  0x80000000u
+#define RW_WAITING 0x40000000u
+
+void _mutex_lock_slow(mutex *m, const char *name);
+void _mutex_wake(mutex *m);
+void _rwlock_rdlock_slow(rwlock *l, const char *name);
+void _rwlock_wrlock_slow(rwlock *l, const char *name);
+void _rwlock_wake(rwlock *l);
+
+#ifdef SYNC_PROFILE
+void _sync_count(sync_stats *s, const char *name);
+#define _sync_fast(l, name) _sync_count(&(l)->stats, name)
+#else
+#define _sync_fast(l, name)
+#endif
+
+static inline void _mutex_lock(mutex *m, const char *name) {
+  unsigned int c = 0;
+  if(!atomic_compare_exchange_strong_explicit(&m->state, &c, 1, memory_order_acquire,
+                                              memory_order_relaxed)) {
+    _mutex_lock_slow(m, name);
+    return;
+  }
+  _sync_fast(m, name);
+}
+
+static inline bool mutex_trylock(mutex *m) {
+  unsigned int c = 0;
+  return atomic_compare_exchange_strong_explicit(&m->state, &c, 1, memory_order_acquire,
+                                                 memory_order_relaxed);
+}
+
+static inline void mutex_unlock(mutex *m) {
+  if(atomic_fetch_sub_explicit(&m->state, 1, memory_order_release) != 1) _mutex_wake(m);
+}
+
+static inline void _rwlock_rdlock(rwlock *l, const char *name) {
+  unsigned int s = atomic_load_explicit(&l->state, memory_order_relaxed);
+  if((s & (RW_WRITER | RW_WAITING)) ||
+     !atomic_compare_exchange_weak_explicit(&l->state, &s, s + 1, memory_order_acquire,
+                                            memory_order_relaxed)) {
+    _rwlock_rdlock_slow(l, name);
+    return;
+  }
+  _sync_fast(l, name);
+}
+
+static inline void rwlock_rdunlock(rwlock *l) {
+  unsigned int s = atomic_fetch_sub_explicit(&l->state, 1, memory_order_release) - 1;
+  if(s == RW_WAITING) _rwlock_wake(l); // last reader out and someone sleeps
+}
+
+static inline void _rwlock_wrlock(rwlock *l, const char *name) {
+  unsigned int s = 0;
+  if(!atomic_compare_exchange_strong_explicit(&l->state, &s, RW_WRITER, memory_order_acquire,
+                                              memory_order_relaxed)) {
+    _rwlock_wrlock_slow(l, name);
+    return;
+  }
+  _sync_fast(l, name);
+}
+
+static inline void rwlock_wrunlock(rwlock *l) {
+  if(atomic_exchange_explicit(&l->state, 0, memory_order_release) & RW_WAITING) _rwlock_wake(l);
+}
+
+#define mutex_lock(m) _mutex_lock((m), SYNC_NAME(m))
+#define rwlock_rdlock(l) _rwlock_rdlock((l), SYNC_NAME(l))
+#define rwlock_wrlock(l) _rwlock_wrlock((l), SYNC_NAME(l))
+
+/* Unlock m, wait for a signal and lock m again. Can wake up spuriously,
+ * always check the condition in a loop. */
+void condvar_wait(condvar *c, mutex *m);
+void condvar_signal(condvar *c);
+void condvar_broadcast(condvar *c);
+
+/* Run the body once with start before and end after it.
+ * Don't return or goto out of the body, end would be skipped. */
+#define defer(name,start,end) for(int __##name = (start,0); !__##name; (__##name += 1), end)
+
+/* Run body holding the mutex */
+#define locking(lck)                                                           \
+  defer(mutex, _mutex_lock(&(lck), SYNC_NAME(lck)), mutex_unlock(&(lck)))
+
+/* Run body holding the rwlock for reading or writing */
+#define reading(lck)                                                           \
+  defer(rdlock, _rwlock_rdlock(&(lck), SYNC_NAME(lck)), rwlock_rdunlock(&(lck)))
+#define writing(lck)                                                           \
+  defer(wrlock, _rwlock_wrlock(&(lck), SYNC_NAME(lck)), rwlock_wrunlock(&(lck)))
+
+/* Print stats of used locks (only with SYNC_PROFILE) */
+void sync_print_stats(FILE *out);
+#endif
+
+#ifdef SYNC_IMPLEMENTATION
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static void sync_futex_wait(atomic_uint *addr, unsigned int val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void sync_futex_wake(atomic_uint *addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline void sync_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield" ::: "memory");
+#else
+  __asm__ volatile("" ::: "memory");
+#endif
+}
+
+/* Spin budget for the next contended lock: twice what was needed lately */
+static int sync_spin_budget(atomic_int *spins) {
+  int s = atomic_load_explicit(spins, memory_order_relaxed) * 2 + 10;
+  return s > SYNC_SPIN_MAX ? SYNC_SPIN_MAX : s;
+}
+
+/* Moving average of spins needed, like glibc adaptive mutexes */
+static void sync_spin_update(atomic_int *spins, int used) {
+  int s = atomic_load_explicit(spins, memory_order_relaxed);
+  atomic_store_explicit(spins, s + (used - s) / 8, memory_order_relaxed);
+}
+
+#ifdef SYNC_PROFILE
+#define SYNC_MAX_PROFILED 256
+static sync_stats *_sync_profiled[SYNC_MAX_PROFILED];
+static atomic_int _sync_profiled_count;
+
+static void sync_register(sync_stats *s, const char *name) {
+  bool expected = false;
+  if(atomic_load_explicit(&s->registered, memory_order_relaxed) ||
+     !atomic_compare_exchange_strong(&s->registered, &expected, true))
+    return;
+  s->name = name;
+  int i = atomic_fetch_add(&_sync_profiled_count, 1);
+  if(i < SYNC_MAX_PROFILED) _sync_profiled[i] = s;
+}
+
+void _sync_count(sync_stats *s, const char *name) {
+  sync_register(s, name);
+  atomic_fetch_add_explicit(&s->acquired, 1, memory_order_relaxed);
+}
+
+static uint64_t sync_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sync_contended(sync_stats *s, const char *name, uint64_t start) {
+  uint64_t ns = sync_now_ns() - start;
+  sync_register(s, name);
+  atomic_fetch_add_explicit(&s->acquired, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->contended, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->wait_ns, ns, memory_order_relaxed);
+  uint64_t us = ns / 1000;
+  int b = us ? 64 - __builtin_clzll(us) : 0;
+  if(b >= SYNC_HIST_BUCKETS) b = SYNC_HIST_BUCKETS - 1;
+  atomic_fetch_add_explicit(&s->hist[b], 1, memory_order_relaxed);
+}
+
+#define SYNC_WAIT_START uint64_t _sync_start = sync_now_ns()
+#define SYNC_WAIT_END(l, name) sync_contended(&(l)->stats, name, _sync_start)
+#else
+#define SYNC_WAIT_START
+#define SYNC_WAIT_END(l, name) (void) name
+#endif
+
+void _mutex_lock_slow(mutex *m, const char *name) {
+  SYNC_WAIT_START;
+  int budget = sync_spin_budget(&m->spins);
+  for(int i = 0; i < budget; i++) {
+    unsigned int c = 0;
+    if(atomic_load_explicit(&m->state, memory_order_relaxed) == 0 &&
+       atomic_compare_exchange_weak_explicit(&m->state, &c, 1, memory_order_acquire,
+                                             memory_order_relaxed)) {
+      sync_spin_update(&m->spins, i);
+      SYNC_WAIT_END(m, name);
+      return;
+    }
+    sync_pause();
+  }
+  sync_spin_update(&m->spins, budget);
+  // mark as contended and sleep until we get it
+  while(atomic_exchange_explicit(&m->state, 2, memory_order_acquire) != 0) {
+    sync_futex_wait(&m->state, 2);
+  }
+  SYNC_WAIT_END(m, name);
+}
+
+void _mutex_wake(mutex *m) {
+  atomic_store_explicit(&m->state, 0, memory_order_release);
+  sync_futex_wake(&m->state, 1);
+}
+
+void _rwlock_rdlock_slow(rwlock *l, const char *name) {
+  SYNC_WAIT_START;
+  int budget = sync_spin_budget(&l->spins);
+  for(int i = 0;; i++) {
+    unsigned int s = atomic_load_explicit(&l->state, memory_order_relaxed);
+    if(!(s & (RW_WRITER | RW_WAITING))) {
+      if(atomic_compare_exchange_weak_explicit(&l->state, &s, s + 1, memory_order_acquire,
+                                               memory_order_relaxed)) {
+        if(i < budget) sync_spin_update(&l->spins, i);
+        break;
+      }
+      continue;
+    }
+    if(i < budget) {
+      sync_pause();
+      continue;
+    }
+    // writer holds or waits for the lock, flag that we sleep
+    if(!(s & RW_WAITING) &&
+       !atomic_compare_exchange_weak_explicit(&l->state, &s, s | RW_WAITING,
+                                              memory_order_relaxed, memory_order_relaxed))
+      continue;
+    sync_futex_wait(&l->state, s | RW_WAITING);
+  }
+  SYNC_WAIT_END(l, name);
+}
+
+void _rwlock_wrlock_slow(rwlock *l, const char *name) {
+  SYNC_WAIT_START;
+  int budget = sync_spin_budget(&l->spins);
+  bool slept = false;
+  for(int i = 0;; i++) {
+    unsigned int s = atomic_load_explicit(&l->state, memory_order_relaxed);
+    if((s & ~RW_WAITING) == 0) {
+      // free, keep the waiting flag if others may sleep (or we slept)
+      unsigned int want = RW_WRITER | ((s | (slept ? RW_WAITING : 0)) & RW_WAITING);
+      if(atomic_compare_exchange_weak_explicit(&l->state, &s, want, memory_order_acquire,
+                                               memory_order_relaxed)) {
+        if(i < budget) sync_spin_update(&l->spins, i);
+        break;
+      }
+      continue;
+    }
+    if(i < budget) {
+      sync_pause();
+      continue;
+    }
+    // blocks new readers too, so a writer doesn't starve
+    if(!(s & RW_WAITING) &&
+       !atomic_compare_exchange_weak_explicit(&l->state, &s, s | RW_WAITING,
+                                              memory_order_relaxed, memory_order_relaxed))
+      continue;
+    sync_futex_wait(&l->state, s | RW_WAITING);
+    slept = true;
+  }
+  SYNC_WAIT_END(l, name);
+}
+
+void _rwlock_wake(rwlock *l) {
+  // clear the flag if nothing changed, everyone woken sets it again if needed
+  unsigned int s = RW_WAITING;
+  atomic_compare_exchange_strong_explicit(&l->state, &s, 0, memory_order_relaxed,
+                                          memory_order_relaxed);
+  sync_futex_wake(&l->state, INT_MAX);
+}
+
+void condvar_wait(condvar *c, mutex *m) {
+  unsigned int seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+  mutex_unlock(m);
+  sync_futex_wait(&c->seq, seq);
+  // others may be waiting for m too, lock as contended
+  while(atomic_exchange_explicit(&m->state, 2, memory_order_acquire) != 0) {
+    sync_futex_wait(&m->state, 2);
+  }
+}
+
+void condvar_signal(condvar *c) {
+  atomic_fetch_add_explicit(&c->seq, 1, memory_order_release);
+  sync_futex_wake(&c->seq, 1);
+}
+
+void condvar_broadcast(condvar *c) {
+  atomic_fetch_add_explicit(&c->seq, 1, memory_order_release);
+  sync_futex_wake(&c->seq, INT_MAX);
+}
+
+void sync_print_stats(FILE *out) {
+#ifdef SYNC_PROFILE
+  int count = atomic_load(&_sync_profiled_count);
+  for(int i = 0; i < count && i < SYNC_MAX_PROFILED; i++) {
+    sync_stats *s = _sync_profiled[i];
+    unsigned long acquired = atomic_load(&s->acquired), contended = atomic_load(&s->contended);
+    fprintf(out, "lock %s: acquired %lu, contended %lu (%.1f%%), waited %.3f ms\n",
+            s->name, acquired, contended, acquired ? 100.0 * contended / acquired : 0.0,
+            atomic_load(&s->wait_ns) / 1e6);
+    for(int b = 0; b < SYNC_HIST_BUCKETS; b++) {
+      unsigned long n = atomic_load(&s->hist[b]);
+      if(n) fprintf(out, "    < %8lu us: %lu\n", 1ul << b, n);
+    }
+  }
+#else
+  (void) out;
+#endif
+}
+#endif